@@ -0,0 +1,231 @@
+/*
+ * alog.c - access log written in the background
+ *
+ * Each thread appends its records to a ring of its own without locking.
+ * A writer thread drains all rings every ALOG_FLUSH_MS and writes them to
+ * the log file as JSON lines. A full ring drops records rather than make
+ * a request wait for the disk, the writer logs how many were dropped.
+ */
+#include "alog.h"
+
+#define ALOG_BUFSIZE (1 << 16)
+
+static int logfd = -1;
+static AlogRing *rings;        /* Only ever prepended to */
+static sem_t mutex;            /* Protects rings */
+static pthread_key_t ringKey;
+static __thread AlogRing *myRing;
+
+/* A thread exits, its ring goes to the next thread that needs one */
+static void releaseRing(void *arg)
+{
+    __atomic_store_n(&((AlogRing *)arg)->owned, 0, __ATOMIC_RELEASE);
+}
+
+static AlogRing* claimRing(void)
+{
+    AlogRing *r;
+    int unowned;
+
+    P(&mutex);
+    for (r = rings; r != NULL; r = r->next)
+    {
+        unowned = 0;
+        if (__atomic_compare_exchange_n(&r->owned, &unowned, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if (r == NULL)
+    {
+        r = Calloc(1, sizeof(AlogRing));
+        r->owned = 1;
+        r->next = rings;
+        rings = r;
+    }
+    V(&mutex);
+    pthread_setspecific(ringKey, r);
+    return r;
+}
+
+/* Append s to the JSON string in buf, escaped */
+static size_t escape(char *buf, const char *s)
+{
+    size_t n = 0;
+
+    for (; *s; s++)
+    {
+        unsigned char ch = *s;
+        if (ch == '"' || ch == '\\')
+        {
+            buf[n++] = '\\';
+            buf[n++] = ch;
+        }
+        else if (ch < 0x20)
+            n += sprintf(buf + n, "\\u%04x", ch);
+        else
+            buf[n++] = ch;
+    }
+    return n;
+}
+
+/* Microseconds from the accept to t, or null */
+static size_t since(char *buf, const char *name, long t, long accept)
+{
+    if (t == 0)
+        return sprintf(buf, ",\"%s\":null", name);
+    return sprintf(buf, ",\"%s\":%ld", name, t - accept);
+}
+
+static size_t format(char *buf, AccessRecord *rec)
+{
+    static const char *caches[] = { "none", "miss", "hit", "disk", "revalidated" };
+    size_t n;
+
+    n = sprintf(buf, "{\"accept\":%ld.%06ld,\"client\":\"", rec->accept / 1000000,
+                rec->accept % 1000000);
+    n += escape(buf + n, rec->client);
+    n += sprintf(buf + n, "\",\"request\":\"");
+    n += escape(buf + n, rec->request);
+    n += sprintf(buf + n, "\",\"cache\":\"%s\",\"status\":%d,\"bytes\":%ld",
+                 caches[rec->cache], rec->status, rec->bytes);
+    n += since(buf + n, "parse_us", rec->parse, rec->accept);
+    n += since(buf + n, "connect_us", rec->connect, rec->accept);
+    n += since(buf + n, "first_byte_us", rec->firstByte, rec->accept);
+    n += since(buf + n, "done_us", rec->done, rec->accept);
+    n += sprintf(buf + n, "}\n");
+    return n;
+}
+
+static void flush(char *buf, size_t *len)
+{
+    if (*len > 0 && write(logfd, buf, *len) < 0)
+        fprintf(stderr, "access log write error: %s\n", strerror(errno));
+    *len = 0;
+}
+
+static void* writer(void *vargp)
+{
+    /* A record escapes to at most 6 bytes per character */
+    size_t maxRecord = 6 * (ALOG_REQUEST_LEN + 64) + 256;
+    char *buf = Malloc(ALOG_BUFSIZE + maxRecord);
+    unsigned long head, dropped;
+    size_t len = 0;
+    AlogRing *r;
+
+    Pthread_detach(pthread_self());
+    while (1)
+    {
+        usleep(ALOG_FLUSH_MS * 1000);
+        P(&mutex);
+        r = rings;
+        V(&mutex);
+
+        for (; r != NULL; r = r->next)
+        {
+            head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+            while (r->tail != head)
+            {
+                len += format(buf + len, &r->recs[r->tail % ALOG_RING]);
+                /* The slot can be reused once tail passes it */
+                __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+                if (len >= ALOG_BUFSIZE)
+                    flush(buf, &len);
+            }
+            if ((dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED)))
+                len += sprintf(buf + len, "{\"dropped\":%lu}\n", dropped);
+        }
+        flush(buf, &len);
+    }
+    return NULL;
+}
+
+/* Start logging to path, appending to what it holds */
+void alog_open(const char *path)
+{
+    pthread_t tid;
+
+    logfd = Open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    Sem_init(&mutex, 0, 1);
+    if (pthread_key_create(&ringKey, releaseRing) != 0)
+        app_error("pthread_key_create error");
+    Pthread_create(&tid, NULL, writer, NULL);
+}
+
+long alog_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* Clear a record for the next request on a connection, accept 0 is now */
+void alog_start(AccessRecord *rec, long accept)
+{
+    rec->accept = accept ? accept : alog_now();
+    rec->parse = rec->connect = rec->firstByte = rec->done = 0;
+    rec->cache = ALOG_NONE;
+    rec->status = 0;
+    rec->bytes = 0;
+    rec->request[0] = '\0';
+}
+
+/* Note the numeric address of the peer of fd */
+void alog_client(AccessRecord *rec, int fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    char host[INET6_ADDRSTRLEN], port[8];
+
+    rec->client[0] = '\0';
+    if (logfd < 0 || getpeername(fd, (SA *)&addr, &len) < 0 ||
+        getnameinfo((SA *)&addr, len, host, sizeof(host), port, sizeof(port),
+                    NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+        return;
+    snprintf(rec->client, sizeof(rec->client), "%s:%s", host, port);
+}
+
+/* Note the request line, without its line end */
+void alog_request(AccessRecord *rec, const char *line)
+{
+    size_t n = strcspn(line, "\r\n");
+
+    if (n >= sizeof(rec->request))
+        n = sizeof(rec->request) - 1;
+    memcpy(rec->request, line, n);
+    rec->request[n] = '\0';
+    rec->parse = alog_now();
+}
+
+/* Note where the response comes from and its status, from its first bytes */
+void alog_response(AccessRecord *rec, AlogCache cache, const char *buf, size_t len)
+{
+    const char *sp = memchr(buf, ' ', len);
+
+    rec->cache = cache;
+    rec->status = sp != NULL ? atoi(sp + 1) : 0;
+    if (rec->firstByte == 0)
+        rec->firstByte = alog_now();
+}
+
+/* Finish a record and queue it for the writer, unless no request was read */
+void alog_write(AccessRecord *rec)
+{
+    AlogRing *r;
+    unsigned long head;
+
+    if (logfd < 0 || rec->request[0] == '\0')
+        return;
+    rec->done = alog_now();
+    if ((r = myRing) == NULL)
+        r = myRing = claimRing();
+
+    head = r->head;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == ALOG_RING)
+    {
+        __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    r->recs[head % ALOG_RING] = *rec;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,51 @@
+#ifndef __ALOG_H__
+#define __ALOG_H__
+
+#include "csapp.h"
+
+#define ALOG_RING 512          /* Records buffered per thread */
+#define ALOG_FLUSH_MS 50       /* How often the writer drains the buffers */
+#define ALOG_REQUEST_LEN 256   /* Longer request lines are cut */
+
+/* Where the response came from */
+typedef enum {
+    ALOG_NONE,                 /* Not served, e.g. an error page */
+    ALOG_MISS,
+    ALOG_HIT,
+    ALOG_DISK,
+    ALOG_REVALIDATED
+} AlogCache;
+
+/* One request, times are microseconds since the epoch, 0 if not reached */
+typedef struct {
+    long accept;               /* Connection accepted, or request started */
+    long parse;                /* Request line parsed */
+    long connect;              /* Connection to the server ready */
+    long firstByte;            /* First byte of the response */
+    long done;
+    AlogCache cache;
+    int status;
+    long bytes;                /* Response bytes */
+    char client[64];           /* "address:port" */
+    char request[ALOG_REQUEST_LEN];
+} AccessRecord;
+
+/* Records of one thread, a single producer single consumer ring */
+typedef struct AlogRing {
+    AccessRecord recs[ALOG_RING];
+    unsigned long head;        /* Next to write, advanced by the owner */
+    unsigned long tail;        /* Next to drain, advanced by the writer */
+    unsigned long dropped;     /* Records lost to a full ring */
+    int owned;                 /* Has a thread writing to it */
+    struct AlogRing *next;
+} AlogRing;
+
+void alog_open(const char *path);
+long alog_now(void);
+void alog_start(AccessRecord *rec, long accept);
+void alog_client(AccessRecord *rec, int fd);
+void alog_request(AccessRecord *rec, const char *line);
+void alog_response(AccessRecord *rec, AlogCache cache, const char *buf, size_t len);
+void alog_write(AccessRecord *rec);
+
+#endif
@@ -0,0 +1,168 @@
+/*
+ * arena.c - boundary tag allocator over a fixed, pre-reserved region
+ *
+ * Each block is charged its own size rounded up to ARENA_ALIGN, plus its
+ * header. A freed block merges with the free blocks on either side, so
+ * the region only fragments between blocks still allocated.
+ */
+#include "arena.h"
+
+#define USED ((size_t)1)
+#define MIN_BLOCK (sizeof(BlockHeader) + sizeof(FreeBlock))
+
+#define HEADER(arena, off) ((BlockHeader *)((arena)->base + (off)))
+#define SIZE(h) ((h)->size & ~USED)
+
+/* The free list class of blocks of size bytes */
+static int sizeClass(size_t size)
+{
+    int c = (int)(sizeof(long) * 8 - 1) - __builtin_clzl(size) - ARENA_MIN_SHIFT;
+    return c < ARENA_NCLASSES ? c : ARENA_NCLASSES - 1;
+}
+
+/* Write the header of the block at off and tell the next one its size */
+static void setBlock(Arena *arena, size_t off, size_t size, size_t used)
+{
+    HEADER(arena, off)->size = size | used;
+    if (off + size < arena->size)
+        HEADER(arena, off + size)->prev = size;
+}
+
+static void pushFree(Arena *arena, size_t off, size_t size)
+{
+    FreeBlock *b = (FreeBlock *)(HEADER(arena, off) + 1);
+    FreeBlock **head = &arena->free[sizeClass(size)];
+
+    setBlock(arena, off, size, 0);
+    b->next = *head;
+    b->pprev = head;
+    if (*head != NULL)
+        (*head)->pprev = &b->next;
+    *head = b;
+}
+
+static void removeFree(Arena *arena, size_t off)
+{
+    FreeBlock *b = (FreeBlock *)(HEADER(arena, off) + 1);
+
+    *b->pprev = b->next;
+    if (b->next != NULL)
+        b->next->pprev = b->pprev;
+}
+
+/* Reserve size bytes, rounded down to ARENA_ALIGN, as one free block */
+void arena_init(Arena *arena, size_t size)
+{
+    arena->size = size / ARENA_ALIGN * ARENA_ALIGN;
+    arena->used = 0;
+    arena->base = Malloc(arena->size);
+    memset(arena->free, 0, sizeof(arena->free));
+    HEADER(arena, 0)->prev = 0;
+    pushFree(arena, 0, arena->size);
+    Sem_init(&arena->mutex, 0, 1);
+}
+
+/* Bytes a block holding n bytes takes from the arena */
+size_t arena_charge(size_t n)
+{
+    size_t size = (sizeof(BlockHeader) + n + ARENA_ALIGN - 1) &
+                  ~(size_t)(ARENA_ALIGN - 1);
+    return size < MIN_BLOCK ? MIN_BLOCK : size;
+}
+
+/* Allocate n bytes from the first free block that fits, NULL if none does */
+void* arena_alloc(Arena *arena, size_t n)
+{
+    size_t size = arena_charge(n), off, total;
+    FreeBlock *b = NULL;
+    BlockHeader *h;
+
+    P(&arena->mutex);
+    for (int c = sizeClass(size); c < ARENA_NCLASSES && b == NULL; c++)
+        for (b = arena->free[c]; b != NULL; b = b->next)
+            if (SIZE((BlockHeader *)b - 1) >= size)
+                break;
+    if (b == NULL)
+    {
+        V(&arena->mutex);
+        return NULL;
+    }
+
+    h = (BlockHeader *)b - 1;
+    off = (char *)h - arena->base;
+    total = SIZE(h);
+    removeFree(arena, off);
+
+    /* Split off the rest unless it is too small to be a block */
+    if (total - size >= MIN_BLOCK)
+    {
+        setBlock(arena, off, size, USED);
+        pushFree(arena, off + size, total - size);
+    }
+    else
+        setBlock(arena, off, size = total, USED);
+    arena->used += size;
+    V(&arena->mutex);
+    return h + 1;
+}
+
+/* Return a block, merging it with the free blocks around it */
+void arena_free(Arena *arena, void *p)
+{
+    BlockHeader *h = (BlockHeader *)p - 1, *next;
+    size_t off = (char *)h - arena->base, size = SIZE(h);
+
+    P(&arena->mutex);
+    arena->used -= size;
+    if (off + size < arena->size &&
+        !((next = HEADER(arena, off + size))->size & USED))
+    {
+        removeFree(arena, off + size);
+        size += SIZE(next);
+    }
+    if (h->prev != 0 && !(HEADER(arena, off - h->prev)->size & USED))
+    {
+        off -= h->prev;
+        removeFree(arena, off);
+        size += SIZE(HEADER(arena, off));
+    }
+    pushFree(arena, off, size);
+    V(&arena->mutex);
+}
+
+/* Bytes charged for the allocated block p */
+size_t arena_block(void *p)
+{
+    return SIZE((BlockHeader *)p - 1);
+}
+
+/*
+ * arena_would_free - whether a block of n bytes would fit around the
+ *                    allocated block p if it and the allocated blocks for
+ *                    which freed(block, arg) returns nonzero were returned
+ */
+int arena_would_free(Arena *arena, void *p, size_t n,
+                     int (*freed)(void *block, void *arg), void *arg)
+{
+    BlockHeader *h = (BlockHeader *)p - 1;
+    size_t start = (char *)h - arena->base, end = start + SIZE(h);
+
+    /* They would merge with each other and the free blocks in between */
+    P(&arena->mutex);
+    while ((h = HEADER(arena, start))->prev != 0)
+    {
+        BlockHeader *prev = HEADER(arena, start - h->prev);
+        if ((prev->size & USED) && !freed(prev + 1, arg))
+            break;
+        start -= h->prev;
+    }
+    while (end < arena->size)
+    {
+        h = HEADER(arena, end);
+        if ((h->size & USED) && !freed(h + 1, arg))
+            break;
+        end += SIZE(h);
+    }
+    V(&arena->mutex);
+    return end - start >= arena_charge(n);
+}
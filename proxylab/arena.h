@@ -0,0 +1,44 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include "csapp.h"
+
+/*
+ * Blocks are multiples of ARENA_ALIGN bytes, a header included. Free
+ * blocks are kept on one list per size class, class c holding blocks of
+ * 2^(c + ARENA_MIN_SHIFT) bytes up to twice that, the last class the rest.
+ */
+#define ARENA_ALIGN 16
+#define ARENA_MIN_SHIFT 5
+#define ARENA_NCLASSES 16
+
+/* Starts every block, free or allocated */
+typedef struct {
+    size_t size;               /* Of the whole block, low bit set while allocated */
+    size_t prev;               /* Size of the block before it, 0 for the first */
+} BlockHeader;
+
+/* Follows the header of a free block */
+typedef struct FreeBlock {
+    struct FreeBlock *next;
+    struct FreeBlock **pprev;
+} FreeBlock;
+
+/* A fixed region carved into blocks of the exact sizes asked for */
+typedef struct {
+    char *base;
+    size_t size;               /* Multiple of ARENA_ALIGN */
+    size_t used;               /* Bytes in allocated blocks */
+    FreeBlock *free[ARENA_NCLASSES];
+    sem_t mutex;               /* Protects everything above */
+} Arena;
+
+void arena_init(Arena *arena, size_t size);
+size_t arena_charge(size_t n);
+void* arena_alloc(Arena *arena, size_t n);
+void arena_free(Arena *arena, void *p);
+size_t arena_block(void *p);
+int arena_would_free(Arena *arena, void *p, size_t n,
+                     int (*freed)(void *block, void *arg), void *arg);
+
+#endif
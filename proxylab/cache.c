@@ -1,93 +1,555 @@
 #include "cache.h"
-#include "lock.h"
-
-void initCache(Cache *cache)
-{
-    cache->head = malloc(sizeof(Node));
-    cache->tail = malloc(sizeof(Node));
-    cache->head->next = cache->tail;
-    cache->head->pre = NULL;
-    cache->head->key = NULL;
-    cache->head->value = NULL;
-    cache->head->size = 0;
-    cache->tail->pre = cache->head;
-    cache->tail->next = NULL;
-    cache->tail->key = NULL;
-    cache->tail->value = NULL;
-    cache->tail->size = 0;
-    cache->size = 0;
+#include "policy.h"
+
+/* What the header block of a response says about caching it */
+typedef struct {
+    int status;
+    int noStore;               /* no-store or private */
+    long maxAge;               /* -1 if not given */
+    time_t date, expires, lastModified;  /* -1 if not given */
+} Freshness;
+
+/* FNV-1a hash of the request line */
+unsigned int hashKey(const char *key)
+{
+    unsigned int h = 2166136261u;
+    while (*key)
+    {
+        h ^= (unsigned char)*key++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Low bits select the bucket, high bits select the shard */
+static Shard* getShard(Cache *cache, unsigned int hash)
+{
+    return &cache->shards[(hash >> 16) % CACHE_NSHARDS];
+}
+
+static void initShard(Shard *shard, const Policy *policy, int admit)
+{
+    initQueues(shard);
+    shard->size = 0;
+    memset(shard->buckets, 0, sizeof(shard->buckets));
+    shard->policy = policy;
+    memset(shard->ghost, 0, sizeof(shard->ghost));
+    shard->ghostNext = 0;
+    memset(shard->sketch, 0, sizeof(shard->sketch));
+    shard->sketchAdds = 0;
+    shard->admit = admit;
+    shard->spill = NULL;
 
     /* Initialize semaphores */
-    initRWLock();
+    initRWLock(&shard->lock);
+    arena_init(&shard->arena, SHARD_SIZE);
+}
+
+void initCache(Cache *cache, const Policy *policy, int admit)
+{
+    for (int i = 0; i < CACHE_NSHARDS; i++)
+        initShard(&cache->shards[i], policy, admit);
+}
+
+/* Hand nodes evicted while still fresh to a next tier */
+void spillCache(Cache *cache, void (*spill)(Node *node))
+{
+    for (int i = 0; i < CACHE_NSHARDS; i++)
+        cache->shards[i].spill = spill;
+}
+
+/* Bytes charged to all shards, read without locking for statistics */
+size_t cacheSize(Cache *cache)
+{
+    size_t size = 0;
+
+    for (int i = 0; i < CACHE_NSHARDS; i++)
+        size += __atomic_load_n(&cache->shards[i].size, __ATOMIC_RELAXED);
+    return size;
+}
+
+/* Parse an HTTP-date such as "Sun, 06 Nov 1994 08:49:37 GMT", -1 if bad */
+static time_t parseDate(const char *s)
+{
+    static const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char mon[4];
+    const char *m;
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(s, " %*[^,], %d %3s %d %d:%d:%d", &tm.tm_mday, mon,
+               &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6 ||
+        (m = strstr(months, mon)) == NULL || (m - months) % 3)
+        return -1;
+    tm.tm_mon = (m - months) / 3;
+    tm.tm_year -= 1900;
+    return timegm(&tm);
+}
+
+/* First occurrence of token in a header value, ignoring case */
+static const char* findToken(const char *value, const char *token)
+{
+    size_t len = strlen(token);
+    for (; *value; value++)
+        if (!strncasecmp(value, token, len))
+            return value;
+    return NULL;
+}
+
+/* Copy the next line of a response head into line, 0 at the end of it */
+static int nextLine(const char **p, const char *end, char *line)
+{
+    const char *eol;
+    size_t n;
+
+    if (*p >= end || (eol = memchr(*p, '\n', end - *p)) == NULL)
+        return 0;
+    n = eol + 1 - *p < MAXLINE ? eol + 1 - *p : MAXLINE - 1;
+    memcpy(line, *p, n);
+    line[n] = '\0';
+    *p = eol + 1;
+    return strcmp(line, "\r\n") && strcmp(line, "\n");
 }
 
-Node* isCached(Cache *cache, const char *request)
+/* Read the caching headers of the response head in buf into f */
+static void parseFreshness(const char *buf, size_t len, Freshness *f)
 {
-    Node *p = cache->head->next;
-    while (p != cache->tail)
+    char line[MAXLINE];
+    const char *v;
+
+    while (nextLine(&buf, buf + len, line))
+    {
+        if (!strncmp(line, "HTTP/", 5))
+            sscanf(line, "%*s %d", &f->status);
+        else if (!strncasecmp(line, "Cache-Control:", 14))
+        {
+            v = line + 14;
+            if (findToken(v, "no-store") || findToken(v, "private"))
+                f->noStore = 1;
+            if (findToken(v, "no-cache"))
+                f->maxAge = 0;
+            else if ((v = findToken(line + 14, "s-maxage=")) != NULL)
+                f->maxAge = atol(v + 9);
+            else if ((v = findToken(line + 14, "max-age=")) != NULL)
+                f->maxAge = atol(v + 8);
+        }
+        else if (!strncasecmp(line, "Expires:", 8))
+            f->expires = parseDate(line + 8);
+        else if (!strncasecmp(line, "Date:", 5))
+            f->date = parseDate(line + 5);
+        else if (!strncasecmp(line, "Last-Modified:", 14))
+            f->lastModified = parseDate(line + 14);
+    }
+}
+
+/*
+ * Copy at most size - 1 bytes of the rest of the header line called name
+ * into value, return 0 if there is none
+ */
+static int findHeader(const char *buf, size_t len, const char *name,
+                      char *value, size_t size)
+{
+    char line[MAXLINE];
+    size_t n = strlen(name), m;
+
+    while (nextLine(&buf, buf + len, line))
+        if (!strncasecmp(line, name, n))
+        {
+            m = strlen(line + n) < size ? strlen(line + n) : size - 1;
+            memcpy(value, line + n, m);
+            value[m] = '\0';
+            return 1;
+        }
+    return 0;
+}
+
+static void initFreshness(Freshness *f)
+{
+    f->status = 0;
+    f->noStore = 0;
+    f->maxAge = -1;
+    f->date = f->expires = f->lastModified = -1;
+}
+
+/* When the response stops being fresh: max-age, then Expires, then heuristics */
+static time_t freshUntil(Freshness *f)
+{
+    time_t now = time(NULL);
+    time_t date = f->date >= 0 ? f->date : now;
+
+    if (f->maxAge >= 0)
+        return now + f->maxAge;
+    if (f->expires >= 0)
+        return now + (f->expires > date ? f->expires - date : 0);
+    if (f->lastModified >= 0 && f->lastModified < date)
+    {
+        time_t ttl = (date - f->lastModified) / 10;
+        return now + (ttl < CACHE_HEURISTIC_TTL ? ttl : CACHE_HEURISTIC_TTL);
+    }
+    return now + CACHE_DEFAULT_TTL;
+}
+
+/* Status codes a response may be cached for without explicit permission */
+static int cacheableStatus(int status)
+{
+    switch (status)
     {
-        if (strcmp(p->key, request) == 0)
+    case 200: case 203: case 204: case 300: case 301: case 308:
+    case 404: case 405: case 410: case 414: case 501:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static Node* isCached(Shard *shard, const char *request, size_t len,
+                      unsigned int hash)
+{
+    Node *p = shard->buckets[hash & (CACHE_NBUCKETS - 1)];
+    while (p != NULL)
+    {
+        if (p->hash == hash && p->keylen == len &&
+            memcmp(p->key, request, len) == 0)
             return p;
-        p = p->next;
+        p = p->hnext;
     }
-        
+
     return NULL;
 }
 
-int readCache(Cache *cache, const char *request, char *buf)
+/* Take a node already out of the policy's queues off the shard */
+static void forgetNode(Shard *shard, Node *node)
+{
+    shard->size -= node->size;
+
+    /* Unlink from the bucket */
+    *node->hpprev = node->hnext;
+    if (node->hnext != NULL)
+        node->hnext->hpprev = node->hpprev;
+
+    /* Readers may still be sending it */
+    releaseNode(node);
+}
+
+static void removeNode(Shard *shard, Node *node)
+{
+    unlinkNode(shard, node);
+    forgetNode(shard, node);
+}
+
+/*
+ * Whether block starts a victim on the list arg that only the cache
+ * still references, so that evicting it returns the block
+ */
+static int isVictim(void *block, void *arg)
 {
-    lock_reader();
+    for (Node *victim = arg; victim != NULL; victim = victim->next)
+        if ((void *)victim == block)
+            return __atomic_load_n(&victim->refcnt, __ATOMIC_RELAXED) == 1;
+    return 0;
+}
+
+/*
+ * Take the policy's victims out of its queues, in its order, until their
+ * blocks would leave a free block of n bytes. Victims still being sent
+ * are taken but do not count, their blocks come back only later. Return
+ * them linked by the next pointer they no longer use, last taken first.
+ * Return NULL and put them all back if there are not enough, or, with
+ * admission on, if they were looked up more often in total than the new
+ * node, budget times. A large node has to displace many nodes, so it only
+ * gets in if it is worth all of them, and nothing is evicted when it is
+ * not. Readers only take references under the reader lock, so while the
+ * writer lock is held the blocks counted stay free to take.
+ */
+static Node* chooseVictims(Shard *shard, size_t n, int budget)
+{
+    Node *victims = NULL, *victim;
+    int freq = 0;
+
+    while ((victim = shard->policy->victim(shard)) != NULL)
+    {
+        unlinkNode(shard, victim);
+        victim->next = victims;
+        victims = victim;
+        if (shard->admit &&
+            (freq += sketchCount(shard, victim->hash)) > budget)
+            break;
+        /* Only the space around the last one can have become free */
+        if (isVictim(victim, victims) &&
+            arena_would_free(&shard->arena, victim, n, isVictim, victims))
+            return victims;
+    }
+
+    /* Each was at the tail when taken, the last taken goes back first */
+    while ((victim = victims) != NULL)
+    {
+        victims = victim->next;
+        pushTail(shard, victim->queue, victim);
+    }
+    return NULL;
+}
+
+/*
+ * Evict the chosen victims. Fresh ones to spill are copied to the heap
+ * first, linked by next on the spilled list, so that their blocks are
+ * free again at once.
+ */
+static void evict(Shard *shard, Node *victims, Node **spilled)
+{
+    Node *victim, *copy;
+
+    while ((victim = victims) != NULL)
+    {
+        victims = victim->next;
+        if (shard->spill != NULL && isFresh(victim))
+        {
+            copy = Malloc(sizeof(Node) + victim->keylen + 1 + victim->valuelen);
+            memcpy(copy, victim,
+                   sizeof(Node) + victim->keylen + 1 + victim->valuelen);
+            copy->key = (char *)(copy + 1);
+            copy->value = copy->key + copy->keylen + 1;
+            copy->next = *spilled;
+            *spilled = copy;
+        }
+        forgetNode(shard, victim);
+    }
+}
+
+/*
+ * readCache - return the cached node with a reference taken, or NULL.
+ *             The value is immutable, the caller sends it and then
+ *             calls releaseNode.
+ */
+Node* readCache(Cache *cache, const char *request)
+{
+    unsigned int hash = hashKey(request);
+    size_t len = strlen(request);
+    Shard *shard = getShard(cache, hash);
     Node *node;
-    if ((node = isCached(cache, request)) != NULL)
-    {
-        strcpy(buf, node->value);
-        unlock_reader();
-
-        /* Update LRU cache */
-        lock_writer();
-        node->pre->next = node->next;
-        node->next->pre = node->pre;
-        node->next = cache->head->next;
-        node->pre = cache->head;
-        cache->head->next->pre = node;
-        cache->head->next = node;
-        unlock_writer();
-        return 0;
+
+    lock_reader(&shard->lock);
+    sketchAdd(shard, hash);
+    if ((node = isCached(shard, request, len, hash)) != NULL)
+    {
+        Node *ret = node;
+        __sync_fetch_and_add(&ret->refcnt, 1);
+        if (!shard->policy->hitNeedsWriter)
+        {
+            /* The policy only marks the node */
+            shard->policy->hit(shard, node);
+            unlock_reader(&shard->lock);
+            return ret;
+        }
+        unlock_reader(&shard->lock);
+
+        /* Reorder the queues, node may have been evicted in between */
+        lock_writer(&shard->lock);
+        if ((node = isCached(shard, request, len, hash)) != NULL)
+            shard->policy->hit(shard, node);
+        unlock_writer(&shard->lock);
+        return ret;
     }
     else
     {
-        unlock_reader();
-        return -1;
+        unlock_reader(&shard->lock);
+        return NULL;
+    }
+}
+
+/*
+ * writeCache - insert the filled response keyed by the request line.
+ *              Node, key and value are copied into one arena block,
+ *              evicting policy victims only once their blocks are known
+ *              to make room for it. With admission on, it is dropped
+ *              instead, and nothing evicted, if the victims together are
+ *              used more often than it.
+ *              Responses that may not be stored are dropped, the others
+ *              expire as their headers say.
+ */
+void writeCache(Cache *cache, const char *key, Fill *fill, int framed)
+{
+    size_t keylen = strlen(key);
+    unsigned int hash = hashKey(key);
+    Shard *shard = getShard(cache, hash);
+    Node *node, *old, *victims, *spilled = NULL;
+    size_t n = sizeof(Node) + keylen + 1 + fill->len;
+    Freshness f;
+
+    if (fill->buf == NULL || fill->len == 0 ||
+        arena_charge(n) > shard->arena.size)
+    {
+        dropFill(fill);
+        return;
+    }
+    initFreshness(&f);
+    parseFreshness(fill->buf, fill->len, &f);
+    if (f.noStore || !cacheableStatus(f.status))
+    {
+        dropFill(fill);
+        return;
+    }
+
+    /* A newer copy replaces an older one */
+    lock_writer(&shard->lock);
+    if ((old = isCached(shard, key, keylen, hash)) != NULL)
+        removeNode(shard, old);
+    if ((node = arena_alloc(&shard->arena, n)) == NULL &&
+        (victims = chooseVictims(shard, n, sketchCount(shard, hash))) != NULL)
+    {
+        evict(shard, victims, &spilled);
+        node = arena_alloc(&shard->arena, n);
     }
+    unlock_writer(&shard->lock);
+
+    /* The next tier may be slow, feed it outside the lock */
+    while (spilled != NULL)
+    {
+        old = spilled;
+        spilled = old->next;
+        shard->spill(old);
+        Free(old);
+    }
+
+    /* Not enough room, or not admitted */
+    if (node == NULL)
+    {
+        dropFill(fill);
+        return;
+    }
+
+    /* Fill the block outside the lock, nobody else can see it yet */
+    node->keylen = keylen;
+    node->key = (char *)(node + 1);
+    memcpy(node->key, key, keylen + 1);
+    node->valuelen = fill->len;
+    node->value = node->key + keylen + 1;
+    memcpy(node->value, fill->buf, fill->len);
+    dropFill(fill);
+    node->hash = hash;
+    node->refcnt = 1;
+    node->framed = framed;
+    node->expires = freshUntil(&f);
+    node->arena = &shard->arena;
+    node->size = arena_block(node);
+    node->freq = 0;
+
+    lock_writer(&shard->lock);
+    if ((old = isCached(shard, key, keylen, hash)) != NULL)
+        removeNode(shard, old);
+    shard->policy->insert(shard, node);
+    shard->size += node->size;
+
+    /* Link into the bucket */
+    Node **bucket = &shard->buckets[node->hash & (CACHE_NBUCKETS - 1)];
+    node->hnext = *bucket;
+    node->hpprev = bucket;
+    if (*bucket != NULL)
+        (*bucket)->hpprev = &node->hnext;
+    *bucket = node;
+    unlock_writer(&shard->lock);
+}
+
+/* Drop one reference, return the block after the last one */
+void releaseNode(Node *node)
+{
+    if (__sync_sub_and_fetch(&node->refcnt, 1) == 0)
+        arena_free(node->arena, node);
+}
+
+/* Whether the node can be served without asking the server */
+int isFresh(Node *node)
+{
+    return time(NULL) < __atomic_load_n(&node->expires, __ATOMIC_RELAXED);
+}
+
+/*
+ * refreshNode - the server answered 304 to a revalidation, fill holds
+ *               that response. Its headers update the freshness of the
+ *               node, the stored response itself is kept.
+ */
+void refreshNode(Node *node, Fill *fill)
+{
+    Freshness f;
+
+    initFreshness(&f);
+    parseFreshness(node->value, node->valuelen, &f);
+    /* Date from the 304, not the one stored */
+    f.date = -1;
+    if (fill->buf != NULL)
+        parseFreshness(fill->buf, fill->len, &f);
+    __atomic_store_n(&node->expires, freshUntil(&f), __ATOMIC_RELAXED);
+    dropFill(fill);
 }
 
-void writeCache(Cache *cache, const char *key, const char *value)
+/*
+ * revalidateHeaders - write the conditional request header that asks the
+ *                     server whether the node is still valid into buf,
+ *                     empty if the node has no validator
+ */
+void revalidateHeaders(Node *node, char *buf)
 {
-    Node *node = malloc(sizeof(Node));
-    node->key = malloc(strlen(key));
-    strcpy(node->key, key);
-    node->value = malloc(strlen(value));
-    strcpy(node->value, value);
-    node->size = strlen(key) + strlen(value);
+    char value[MAXLINE - 32];
+
+    buf[0] = '\0';
+    if (findHeader(node->value, node->valuelen, "ETag:", value, sizeof(value)))
+        sprintf(buf, "If-None-Match:%s", value);
+    else if (findHeader(node->value, node->valuelen, "Last-Modified:",
+                        value, sizeof(value)))
+        sprintf(buf, "If-Modified-Since:%s", value);
+}
 
-    /* Adopt LRU policy */
-    lock_writer();
-    while (cache->size + node->size > MAX_CACHE_SIZE)
-        evict(cache);
+/* Start an empty fill, a node may hold MAX_OBJECT_SIZE with its key */
+void initFill(Fill *fill, const char *key)
+{
+    fill->buf = NULL;
+    fill->len = 0;
+    fill->cap = 0;
+    fill->limit = MAX_OBJECT_SIZE - strlen(key);
+}
+
+/* Tee n more bytes of the response, give up once it is too large */
+void appendFill(Fill *fill, const char *data, size_t n)
+{
+    size_t need = fill->len + n;
+
+    if (need > fill->limit)
+    {
+        dropFill(fill);
+        fill->len = need;
+        return;
+    }
+    if (need > fill->cap)
+    {
+        /* Grow geometrically so that the copies stay linear */
+        size_t cap = fill->cap ? 2 * fill->cap : MAXBUF;
+        while (cap < need)
+            cap *= 2;
+        if (cap > fill->limit)
+            cap = fill->limit;
+        fill->buf = Realloc(fill->buf, cap);
+        fill->cap = cap;
+    }
+    memcpy(fill->buf + fill->len, data, n);
+    fill->len = need;
+}
+
+/* Insert n bytes at off, such as a header the response came without */
+void insertFill(Fill *fill, size_t off, const char *data, size_t n)
+{
+    size_t tail = fill->len - off;
 
-    node->next = cache->head->next;
-    node->pre = cache->head;
-    cache->head->next->pre = node;
-    cache->head->next = node;
-    cache->size += node->size;
-    unlock_writer();
+    appendFill(fill, data, n);
+    if (fill->buf == NULL)
+        return;
+    memmove(fill->buf + off + n, fill->buf + off, tail);
+    memcpy(fill->buf + off, data, n);
 }
 
-void evict(Cache *cache)
+/* Give up on caching this response, later bytes are only counted */
+void dropFill(Fill *fill)
 {
-    Node *last = cache->tail->pre;
-    last->pre->next = cache->tail;
-    cache->tail->pre = last->pre;
-    cache->size -= last->size;
-    free(last);
+    free(fill->buf);
+    fill->buf = NULL;
+    fill->cap = 0;
+    fill->limit = 0;
 }
\ No newline at end of file
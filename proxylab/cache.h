@@ -1,27 +1,118 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <time.h>
 #include "csapp.h"
+#include "lock.h"
+#include "arena.h"
 
 /* Recommended max cache and object sizes */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 
+/*
+ * Number of independently locked shards, each shard must hold one object
+ * with its node, key and block header. Nodes are charged their exact size
+ * rounded up to ARENA_ALIGN, so a shard fills up with objects, but an
+ * object can only displace nodes of its own shard.
+ */
+#ifndef CACHE_NSHARDS
+#define CACHE_NSHARDS 8
+#endif
+#define SHARD_SIZE (MAX_CACHE_SIZE / CACHE_NSHARDS)
+#if SHARD_SIZE < MAX_OBJECT_SIZE + 1024
+#error "a cache shard must hold the largest object"
+#endif
+
+/* Seconds a response without freshness headers stays fresh, and the most
+   a Last-Modified heuristic may give */
+#define CACHE_DEFAULT_TTL 60
+#define CACHE_HEURISTIC_TTL 86400
+
+/* Number of hash buckets per shard, power of 2 */
+#define CACHE_NBUCKETS 256
+
+/* Eviction policy state */
+#define CACHE_NQUEUES 3
+#define GHOST_SIZE 64
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 512
+
+/* A node, its key and its value share one arena block */
 typedef struct ListNode {
-    char *key;
-    char *value;
+    char *key;                 /* Request line, NUL terminated */
+    char *value;               /* Response bytes, may contain NUL */
+    size_t keylen;
+    size_t valuelen;
     struct ListNode *pre;
     struct ListNode *next;
-    size_t size;
+    struct ListNode *hnext;    /* Next node in the same bucket */
+    struct ListNode **hpprev;  /* Link pointing to this node in the bucket */
+    unsigned int hash;         /* Precomputed hash of key */
+    int refcnt;                /* References held by the cache and readers */
+    int framed;                /* Response ends by Content-Length or chunks */
+    time_t expires;            /* Stale from then on, must be revalidated */
+    int queue;                 /* Which policy queue holds it */
+    int freq;                  /* Reference bit or count kept by the policy */
+    Arena *arena;              /* Where the block goes back to */
+    size_t size;               /* Bytes charged to the shard, its block */
 } Node;
 
-/* Use list to construct the cache */
+/* A list of nodes between two sentinels, head is most recent */
+typedef struct {
+    Node head;
+    Node tail;
+    size_t size;               /* Bytes charged by its nodes */
+} Queue;
+
+struct Policy;
+
+/*
+ * Each shard keeps its nodes in the queues of its eviction policy,
+ * indexed by a hash table, stored in its arena
+ */
 typedef struct {
-    Node *head;
-    Node *tail;
+    Queue queues[CACHE_NQUEUES];
+    Node *buckets[CACHE_NBUCKETS];
     size_t size;
+    RWLock lock;
+    Arena arena;
+    const struct Policy *policy;
+    unsigned int ghost[GHOST_SIZE];    /* S3-FIFO: hashes recently evicted */
+    int ghostNext;
+    unsigned char sketch[SKETCH_DEPTH][SKETCH_WIDTH];  /* Lookups per key */
+    unsigned int sketchAdds;
+    int admit;                         /* Filter new nodes by frequency */
+    void (*spill)(Node *node);         /* Takes fresh evicted nodes if set */
+} Shard;
+
+/* Keys are spread over shards by hash */
+typedef struct {
+    Shard shards[CACHE_NSHARDS];
 } Cache;
 
-void initCache(Cache *cache);
-Node* isCached(Cache *cache, const char *request);
-int readCache(Cache *cache, const char *request, char *buf);
-void writeCache(Cache *cache, const char *key, const char *value);
-void evict(Cache *cache);
+/* A response being copied into a cache entry while it is forwarded */
+typedef struct {
+    char *buf;                 /* NULL until the first byte or once dropped */
+    size_t len;                /* Bytes appended so far */
+    size_t cap;
+    size_t limit;              /* Largest value worth caching */
+} Fill;
+
+unsigned int hashKey(const char *key);
+void initCache(Cache *cache, const struct Policy *policy, int admit);
+void spillCache(Cache *cache, void (*spill)(Node *node));
+size_t cacheSize(Cache *cache);
+Node* readCache(Cache *cache, const char *request);
+void writeCache(Cache *cache, const char *key, Fill *fill, int framed);
+void releaseNode(Node *node);
+int isFresh(Node *node);
+void refreshNode(Node *node, Fill *fill);
+void revalidateHeaders(Node *node, char *buf);
+
+void initFill(Fill *fill, const char *key);
+void appendFill(Fill *fill, const char *data, size_t n);
+void insertFill(Fill *fill, size_t off, const char *data, size_t n);
+void dropFill(Fill *fill);
 
+#endif
@@ -0,0 +1,224 @@
+/*
+ * cachebench.c - benchmark for the proxy cache
+ *
+ * Stress mode fills the cache with small objects and measures cache hit
+ * throughput with 1, 2, 4, ... worker threads all reading from the cache.
+ *
+ * Replay mode replays a request log against each eviction policy (or the
+ * one given with -p), with and without the admission filter, fetching
+ * missed objects into the cache, and reports hit ratio, byte hit ratio and
+ * ops/sec. A log has one "<size> <url>" per line, -z generates a Zipf
+ * distributed log instead, with -s percent of it replaced by one-off
+ * objects of MAX_OBJECT_SIZE / 2 as a scan.
+ *
+ * usage: ./cachebench [-p policy] [-n maxthreads] [-o ops per thread]
+ *        ./cachebench [-p policy] -t logfile
+ *        ./cachebench [-p policy] -z nrequests [-a alpha] [-s percent]
+ * Build with -DCACHE_NSHARDS=1 to compare against a single global lock.
+ */
+#include "csapp.h"
+#include "cache.h"
+#include "policy.h"
+
+#define NKEYS 1024
+#define OBJSIZE 512
+#define ZIPF_NOBJECTS 5000
+
+typedef struct {
+    char *key;
+    size_t size;
+} Request;
+
+static Cache cache;
+static char keys[NKEYS][64];
+static int nops;
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void* worker(void *vargp)
+{
+    unsigned int seed = (unsigned int)(long)vargp;
+    Node *node;
+
+    for (int i = 0; i < nops; i++)
+        if ((node = readCache(&cache, keys[rand_r(&seed) % NKEYS])) != NULL)
+            releaseNode(node);
+    return NULL;
+}
+
+static void fillCache(Cache *c, const char *key, size_t size)
+{
+    static char value[MAX_OBJECT_SIZE] = "HTTP/1.0 200 OK\r\n\r\n";
+    Fill fill;
+
+    initFill(&fill, key);
+    appendFill(&fill, value, size);
+    writeCache(c, key, &fill, 1);
+}
+
+static void stress(const Policy *policy, int maxthreads)
+{
+    pthread_t tids[maxthreads];
+
+    initCache(&cache, policy, 1);
+    for (int i = 0; i < NKEYS; i++)
+    {
+        sprintf(keys[i], "GET http://localhost/obj%d HTTP/1.0\r\n", i);
+        fillCache(&cache, keys[i], OBJSIZE);
+    }
+
+    printf("shards: %d  policy: %s\n", CACHE_NSHARDS, policy->name);
+    for (int n = 1; n <= maxthreads; n *= 2)
+    {
+        double start = now();
+        for (int i = 0; i < n; i++)
+            Pthread_create(&tids[i], NULL, worker, (void *)(long)(i + 1));
+        for (int i = 0; i < n; i++)
+            Pthread_join(tids[i], NULL);
+        double secs = now() - start;
+        printf("threads: %2d  hits/sec: %.0f\n", n, (double)n * nops / secs);
+    }
+}
+
+static Request* readLog(const char *file, int *n)
+{
+    FILE *fp = Fopen(file, "r");
+    char line[MAXLINE], url[MAXLINE], key[MAXLINE + 32];
+    int cap = 1024;
+    Request *reqs = Malloc(cap * sizeof(Request));
+    size_t size;
+
+    *n = 0;
+    while (fgets(line, MAXLINE, fp) != NULL)
+    {
+        if (sscanf(line, "%zu %s", &size, url) != 2)
+            continue;
+        if (*n == cap)
+            reqs = Realloc(reqs, (cap *= 2) * sizeof(Request));
+        sprintf(key, "GET %s HTTP/1.0\r\n", url);
+        reqs[*n].key = strdup(key);
+        reqs[*n].size = size;
+        (*n)++;
+    }
+    Fclose(fp);
+    return reqs;
+}
+
+/* n requests over ZIPF_NOBJECTS objects of 256 B to 64 KB */
+static Request* zipfLog(int n, double alpha, int scan)
+{
+    double *cdf = Malloc(ZIPF_NOBJECTS * sizeof(double));
+    Request *reqs = Malloc(n * sizeof(Request));
+    char key[MAXLINE];
+    double sum = 0;
+    unsigned int seed = 1;
+
+    for (int i = 0; i < ZIPF_NOBJECTS; i++)
+        cdf[i] = (sum += 1.0 / pow(i + 1, alpha));
+    for (int i = 0; i < n; i++)
+    {
+        double u = (double)rand_r(&seed) / RAND_MAX * sum;
+        int lo = 0, hi = ZIPF_NOBJECTS - 1;
+        while (lo < hi)
+        {
+            int mid = (lo + hi) / 2;
+            if (cdf[mid] < u)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        sprintf(key, "GET http://localhost/zipf%d HTTP/1.0\r\n", lo);
+        reqs[i].size = 256 << (hashKey(key) % 9);
+        if (rand_r(&seed) % 100 < scan)
+        {
+            sprintf(key, "GET http://localhost/scan%d HTTP/1.0\r\n", i);
+            reqs[i].size = MAX_OBJECT_SIZE / 2;
+        }
+        reqs[i].key = strdup(key);
+    }
+    Free(cdf);
+    return reqs;
+}
+
+static void replay(const Policy *policy, int admit, Request *reqs, int n)
+{
+    Cache *c = Malloc(sizeof(Cache));
+    long hits = 0;
+    double bytes = 0, hitBytes = 0;
+    Node *node;
+
+    initCache(c, policy, admit);
+    double start = now();
+    for (int i = 0; i < n; i++)
+    {
+        bytes += reqs[i].size;
+        if ((node = readCache(c, reqs[i].key)) != NULL)
+        {
+            hits++;
+            hitBytes += reqs[i].size;
+            releaseNode(node);
+        }
+        else
+            fillCache(c, reqs[i].key, reqs[i].size);
+    }
+    double secs = now() - start;
+    printf("%-8s %-6s  hit ratio: %.4f  byte hit ratio: %.4f  ops/sec: %.0f\n",
+           policy->name, admit ? "admit" : "all", (double)hits / n,
+           hitBytes / bytes, n / secs);
+}
+
+int main(int argc, char **argv)
+{
+    const Policy *policies[] = {
+        &lruPolicy, &clockPolicy, &s3fifoPolicy, &tinylfuPolicy
+    };
+    const Policy *policy = NULL;
+    char *logfile = NULL;
+    int maxthreads = 8, zipf = 0, scan = 0, n, c;
+    double alpha = 0.9;
+    Request *reqs;
+
+    nops = 200000;
+    while ((c = getopt(argc, argv, "p:n:o:t:z:a:s:")) != -1)
+    {
+        switch (c)
+        {
+        case 'p':
+            if ((policy = findPolicy(optarg)) == NULL)
+                app_error("unknown policy");
+            break;
+        case 'n': maxthreads = atoi(optarg); break;
+        case 'o': nops = atoi(optarg); break;
+        case 't': logfile = optarg; break;
+        case 'z': zipf = atoi(optarg); break;
+        case 'a': alpha = atof(optarg); break;
+        case 's': scan = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-p policy] [-n maxthreads] [-o ops] "
+                    "[-t logfile | -z nrequests [-a alpha] [-s scan%%]]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    if (logfile == NULL && zipf == 0)
+    {
+        stress(policy ? policy : &lruPolicy, maxthreads);
+        return 0;
+    }
+
+    if (logfile != NULL)
+        reqs = readLog(logfile, &n);
+    else
+        reqs = zipfLog(n = zipf, alpha, scan);
+    printf("shards: %d  requests: %d\n", CACHE_NSHARDS, n);
+    for (int i = 0; i < sizeof(policies) / sizeof(policies[0]); i++)
+        if (policy == NULL || policy == policies[i])
+            for (int admit = 0; admit <= 1; admit++)
+                replay(policies[i], admit, reqs, n);
+    return 0;
+}
@@ -0,0 +1,219 @@
+/*
+ * cachecheck.c - checks for the proxy cache
+ *
+ * Inserts objects, reads them back and compares every byte, for each
+ * eviction policy: objects up to the largest size round trip, larger ones
+ * are dropped, eviction keeps a shard within its arena, a node still
+ * referenced by a reader is neither overwritten nor counted as space, and
+ * its block goes back to the arena with the last reference.
+ *
+ * usage: ./cachecheck [-p policy]
+ * Exits with status 1 if any check failed.
+ */
+#include "csapp.h"
+#include "cache.h"
+#include "policy.h"
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+static const char *head = "HTTP/1.0 200 OK\r\n\r\n";
+static Cache cache;
+static const Policy *current;
+static int failures;
+
+static void check(int ok, const char *what, int line)
+{
+    if (!ok)
+    {
+        printf("%s: line %d: %s\n", current->name, line, what);
+        failures++;
+    }
+}
+
+/* The value stored for object id, size bytes in all */
+static void makeValue(char *buf, int id, size_t size)
+{
+    size_t n = strlen(head);
+
+    memcpy(buf, head, n);
+    for (size_t i = n; i < size; i++)
+        buf[i] = (char)(id * 31 + i);
+}
+
+static void put(const char *key, int id, size_t size)
+{
+    static char value[MAX_OBJECT_SIZE + 1];
+    Fill fill;
+
+    makeValue(value, id, size);
+    initFill(&fill, key);
+    appendFill(&fill, value, size);
+    writeCache(&cache, key, &fill, 1);
+}
+
+/* Whether key is cached with the value of object id, size bytes */
+static int cached(const char *key, int id, size_t size)
+{
+    static char value[MAX_OBJECT_SIZE + 1];
+    Node *node;
+    int same;
+
+    if ((node = readCache(&cache, key)) == NULL)
+        return 0;
+    makeValue(value, id, size);
+    same = node->valuelen == size && node->keylen == strlen(key) &&
+           !strcmp(node->key, key) && !memcmp(node->value, value, size);
+    releaseNode(node);
+    return same;
+}
+
+/* The next key from *next on that goes to shard 0 */
+static void shardKey(char *key, int *next)
+{
+    do
+        sprintf(key, "GET http://localhost/check%d HTTP/1.0\r\n", (*next)++);
+    while ((hashKey(key) >> 16) % CACHE_NSHARDS != 0);
+}
+
+static void roundTrip(void)
+{
+    char key[64];
+    int i;
+
+    initCache(&cache, current, 0);
+    for (i = 0; i < 200; i++)
+    {
+        sprintf(key, "GET http://localhost/obj%d HTTP/1.0\r\n", i);
+        put(key, i, strlen(head) + (size_t)i * 37 % 5000);
+    }
+    for (i = 0; i < 200; i++)
+    {
+        sprintf(key, "GET http://localhost/obj%d HTTP/1.0\r\n", i);
+        CHECK(cached(key, i, strlen(head) + (size_t)i * 37 % 5000));
+    }
+
+    /* A newer copy replaces the older one */
+    sprintf(key, "GET http://localhost/obj%d HTTP/1.0\r\n", 0);
+    put(key, 1000, 4000);
+    CHECK(cached(key, 1000, 4000));
+}
+
+static void oversized(void)
+{
+    char key[64];
+    int next = 0;
+    size_t limit;
+
+    initCache(&cache, current, 0);
+    shardKey(key, &next);
+    limit = MAX_OBJECT_SIZE - strlen(key);
+    put(key, 1, limit);
+    CHECK(cached(key, 1, limit));
+
+    shardKey(key, &next);
+    put(key, 2, limit + 1);
+    CHECK(readCache(&cache, key) == NULL);
+}
+
+static void eviction(void)
+{
+    Shard *shard = &cache.shards[0];
+    char keys[12][64];
+    int next = 0, present = 0;
+    Node *node;
+
+    initCache(&cache, current, 0);
+    for (int i = 0; i < 12; i++)
+        shardKey(keys[i], &next);
+
+    /* Three objects of nearly a third of the shard share it */
+    for (int i = 0; i < 3; i++)
+        put(keys[i], i, SHARD_SIZE * 3 / 10);
+    for (int i = 0; i < 3; i++)
+        CHECK(cached(keys[i], i, SHARD_SIZE * 3 / 10));
+
+    /* More than fits, the shard stays within its arena */
+    for (int i = 3; i < 12; i++)
+        put(keys[i], i, SHARD_SIZE / 4);
+    CHECK(shard->size <= shard->arena.size);
+    CHECK(shard->arena.used == shard->size);
+    for (int i = 3; i < 12; i++)
+        if ((node = readCache(&cache, keys[i])) != NULL)
+        {
+            releaseNode(node);
+            CHECK(cached(keys[i], i, SHARD_SIZE / 4));
+            present++;
+        }
+    CHECK(present > 0 && present < 9);
+    CHECK(cached(keys[11], 11, SHARD_SIZE / 4));
+    if (current == &lruPolicy)
+    {
+        CHECK(readCache(&cache, keys[0]) == NULL);
+        CHECK(readCache(&cache, keys[2]) == NULL);
+    }
+}
+
+static void references(void)
+{
+    Shard *shard = &cache.shards[0];
+    char a[64], b[64], value[MAX_OBJECT_SIZE];
+    int next = 0;
+    size_t big = MAX_OBJECT_SIZE - 64, size;
+    Node *held;
+
+    initCache(&cache, current, 0);
+    shardKey(a, &next);
+    shardKey(b, &next);
+
+    /* The only victim is being sent, so nothing is evicted for b */
+    put(a, 1, big);
+    held = readCache(&cache, a);
+    put(b, 2, big);
+    CHECK(readCache(&cache, b) == NULL);
+    CHECK(cached(a, 1, big));
+    releaseNode(held);
+    put(b, 2, big);
+    CHECK(cached(b, 2, big));
+    CHECK(readCache(&cache, a) == NULL);
+
+    /* A replaced node stays intact for its reader, its block comes back
+       with the last reference */
+    put(a, 3, 1000);
+    held = readCache(&cache, a);
+    size = held->size;
+    put(a, 4, 2000);
+    CHECK(cached(a, 4, 2000));
+    makeValue(value, 3, 1000);
+    CHECK(held->valuelen == 1000 && !memcmp(held->value, value, 1000));
+    CHECK(shard->arena.used == shard->size + size);
+    releaseNode(held);
+    CHECK(shard->arena.used == shard->size);
+}
+
+int main(int argc, char **argv)
+{
+    const Policy *policies[] = { &lruPolicy, &clockPolicy, &s3fifoPolicy,
+                                 &tinylfuPolicy };
+    const Policy *only = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "p:")) != -1)
+        if (c != 'p' || (only = findPolicy(optarg)) == NULL)
+        {
+            fprintf(stderr, "usage: %s [-p policy]\n", argv[0]);
+            exit(2);
+        }
+
+    for (int i = 0; i < 4; i++)
+    {
+        if (only != NULL && policies[i] != only)
+            continue;
+        current = policies[i];
+        roundTrip();
+        oversized();
+        eviction();
+        references();
+        printf("%-8s %s\n", current->name, failures ? "FAILED" : "ok");
+    }
+    return failures ? 1 : 0;
+}
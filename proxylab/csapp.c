@@ -893,6 +893,137 @@ ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
 }
 /* $end rio_readlineb */
 
+/*
+ * rio_fill - Read more bytes into the buffer behind the unread ones,
+ *     moving those to its front if they reach its end, so that they can
+ *     be parsed in place. Returns the number of bytes read, 0 on EOF and
+ *     -1 on error, with errno ENOBUFS if the unread bytes fill the buffer.
+ */
+ssize_t rio_fill(rio_t *rp)
+{
+    ssize_t n;
+    char *end;
+
+    if (rp->rio_cnt >= RIO_BUFSIZE) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    if (rp->rio_cnt <= 0)
+        rp->rio_bufptr = rp->rio_buf;
+    end = rp->rio_bufptr + rp->rio_cnt;
+    if (end == rp->rio_buf + RIO_BUFSIZE) {
+        memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+        rp->rio_bufptr = rp->rio_buf;
+        end = rp->rio_buf + rp->rio_cnt;
+    }
+    while ((n = read(rp->rio_fd, end, rp->rio_buf + RIO_BUFSIZE - end)) < 0)
+        if (errno != EINTR)
+            return -1;
+    rp->rio_cnt += n;
+    return n;
+}
+
+/*
+ * rio_writeinitb - Start an empty batch of output for a descriptor
+ */
+void rio_writeinitb(rio_writer_t *wp, int fd)
+{
+    wp->rio_fd = fd;
+    wp->rio_iovcnt = 0;
+    wp->rio_wlen = 0;
+}
+
+/*
+ * rio_writeb - Queue n bytes of usrbuf, which must stay as they are until
+ *     flushed. Returns n, or -1 if a flush to make room failed.
+ */
+ssize_t rio_writeb(rio_writer_t *wp, void *usrbuf, size_t n)
+{
+    struct iovec *last;
+
+    if (n == 0)
+        return 0;
+    /* Pieces formatted one after another are sent as one */
+    if (wp->rio_iovcnt > 0) {
+        last = &wp->rio_iov[wp->rio_iovcnt - 1];
+        if ((char *)last->iov_base + last->iov_len == usrbuf) {
+            last->iov_len += n;
+            return n;
+        }
+    }
+    if (wp->rio_iovcnt == RIO_MAXIOV && rio_flushb(wp) < 0)
+        return -1;
+    wp->rio_iov[wp->rio_iovcnt].iov_base = usrbuf;
+    wp->rio_iov[wp->rio_iovcnt].iov_len = n;
+    wp->rio_iovcnt++;
+    return n;
+}
+
+/*
+ * rio_printfb - Queue formatted text, flushing first if it does not fit.
+ *     Returns its length, or -1 on error or if it is longer than wbuf.
+ */
+ssize_t rio_printfb(rio_writer_t *wp, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+    char *p;
+
+    if (wp->rio_iovcnt == RIO_MAXIOV && rio_flushb(wp) < 0)
+        return -1;
+    va_start(ap, fmt);
+    n = vsnprintf(wp->rio_wbuf + wp->rio_wlen, RIO_BUFSIZE - wp->rio_wlen, fmt, ap);
+    va_end(ap);
+    if (n >= 0 && n >= RIO_BUFSIZE - wp->rio_wlen && wp->rio_wlen > 0) {
+        if (rio_flushb(wp) < 0)
+            return -1;
+        va_start(ap, fmt);
+        n = vsnprintf(wp->rio_wbuf, RIO_BUFSIZE, fmt, ap);
+        va_end(ap);
+    }
+    if (n < 0 || n >= RIO_BUFSIZE - wp->rio_wlen) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    p = wp->rio_wbuf + wp->rio_wlen;
+    wp->rio_wlen += n;
+    return rio_writeb(wp, p, n);
+}
+
+/*
+ * rio_flushb - Robustly write all queued output, with one writev if the
+ *     descriptor takes it. Returns 0, or -1 on error, in which case the
+ *     output stays queued and can be flushed again, e.g. to another fd.
+ */
+int rio_flushb(rio_writer_t *wp)
+{
+    struct iovec iov[RIO_MAXIOV], *p = iov;
+    int cnt = wp->rio_iovcnt;
+    ssize_t n;
+
+    memcpy(iov, wp->rio_iov, cnt * sizeof(struct iovec));
+    while (cnt > 0) {
+        if ((n = writev(wp->rio_fd, p, cnt)) < 0) {
+            if (errno == EINTR)  /* Interrupted by sig handler return */
+                continue;
+            return -1;
+        }
+        /* Skip what was written, resume within a piece if need be */
+        while (cnt > 0 && (size_t)n >= p->iov_len) {
+            n -= p->iov_len;
+            p++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            p->iov_base = (char *)p->iov_base + n;
+            p->iov_len -= n;
+        }
+    }
+    wp->rio_iovcnt = 0;
+    wp->rio_wlen = 0;
+    return 0;
+}
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -934,6 +1065,32 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
     return rc;
 } 
 
+void Rio_writeb(rio_writer_t *wp, void *usrbuf, size_t n)
+{
+    if (rio_writeb(wp, usrbuf, n) < 0)
+	unix_error("Rio_writeb error");
+}
+
+void Rio_printfb(rio_writer_t *wp, const char *fmt, ...)
+{
+    va_list ap;
+    char buf[RIO_BUFSIZE];
+    int n;
+
+    /* Formatted here so that it can be handed on */
+    va_start(ap, fmt);
+    n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n < 0 || n >= sizeof(buf) || rio_printfb(wp, "%s", buf) < 0)
+	unix_error("Rio_printfb error");
+}
+
+void Rio_flushb(rio_writer_t *wp)
+{
+    if (rio_flushb(wp) < 0)
+	unix_error("Rio_flushb error");
+}
+
 /******************************** 
  * Client/server helper functions
  ********************************/
@@ -994,7 +1151,7 @@ int open_clientfd(char *hostname, char *port) {
  *       -1 with errno set for other errors.
  */
 /* $begin open_listenfd */
-int open_listenfd(char *port) 
+static int open_listenfd_opt(char *port, int reuseport)
 {
     struct addrinfo hints, *listp, *p;
     int listenfd, rc, optval=1;
@@ -1019,6 +1176,14 @@ int open_listenfd(char *port)
         setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,    //line:netp:csapp:setsockopt
                    (const void *)&optval , sizeof(int));
 
+        /* Share the port with other sockets, the kernel balances between them */
+        if (reuseport &&
+            setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                       (const void *)&optval , sizeof(int)) < 0) {
+            close(listenfd);
+            continue;
+        }
+
         /* Bind the descriptor to the address */
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
             break; /* Success */
@@ -1041,6 +1206,21 @@ int open_listenfd(char *port)
     }
     return listenfd;
 }
+
+int open_listenfd(char *port) 
+{
+    return open_listenfd_opt(port, 0);
+}
+
+/*
+ * open_listenfd_reuseport - Like open_listenfd, but any number of sockets
+ *     opened this way may listen on the same port. Each gets its own
+ *     accept queue.
+ */
+int open_listenfd_reuseport(char *port)
+{
+    return open_listenfd_opt(port, 1);
+}
 /* $end open_listenfd */
 
 /****************************************************
@@ -1064,6 +1244,15 @@ int Open_listenfd(char *port)
     return rc;
 }
 
+int Open_listenfd_reuseport(char *port) 
+{
+    int rc;
+
+    if ((rc = open_listenfd_reuseport(port)) < 0)
+	unix_error("Open_listenfd_reuseport error");
+    return rc;
+}
+
 /* $end csapp.c */
 
 
@@ -0,0 +1,247 @@
+/*
+ * disk.c - second cache tier in a file of log-structured segments
+ *
+ * Nodes evicted from memory are appended to the current segment of the
+ * mmap'ed file. Once it is full the next segment of the ring is reused and
+ * whatever it held is forgotten. Hits are sent straight from the file with
+ * sendfile. On startup the index is rebuilt by replaying the segments from
+ * the oldest to the newest, so a newer record of a key overrides an older.
+ */
+#include <sys/sendfile.h>
+#include "disk.h"
+
+#define SEGMENT(offset) ((int)((offset) / DISK_SEGMENT_SIZE))
+#define ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+static DiskRecord* recordAt(DiskCache *dc, size_t offset)
+{
+    return (DiskRecord *)(dc->base + offset);
+}
+
+/* Link to the entry of key, or to the NULL ending its bucket */
+static DiskEntry** findEntry(DiskCache *dc, const char *key, size_t keylen,
+                             unsigned int hash)
+{
+    DiskEntry **pp = &dc->buckets[hash % DISK_NBUCKETS];
+
+    for (; *pp != NULL; pp = &(*pp)->next)
+    {
+        DiskRecord *r = recordAt(dc, (*pp)->offset);
+        if ((*pp)->hash == hash && r->keylen == keylen &&
+            !memcmp(r + 1, key, keylen))
+            break;
+    }
+    return pp;
+}
+
+/* Point the key of the record at offset to it */
+static void indexRecord(DiskCache *dc, size_t offset)
+{
+    DiskRecord *r = recordAt(dc, offset);
+    DiskEntry **pp = findEntry(dc, (char *)(r + 1), r->keylen, r->hash);
+
+    if (*pp == NULL)
+    {
+        *pp = Malloc(sizeof(DiskEntry));
+        (*pp)->hash = r->hash;
+        (*pp)->next = NULL;
+    }
+    (*pp)->offset = offset;
+}
+
+/* Reuse a segment, forgetting the records it held */
+static void startSegment(DiskCache *dc, int segment)
+{
+    DiskSegment *s = (DiskSegment *)(dc->base + (size_t)segment * DISK_SEGMENT_SIZE);
+
+    for (int i = 0; i < DISK_NBUCKETS; i++)
+    {
+        DiskEntry **pp = &dc->buckets[i], *e;
+        while ((e = *pp) != NULL)
+        {
+            if (SEGMENT(e->offset) == segment)
+            {
+                *pp = e->next;
+                Free(e);
+            }
+            else
+                pp = &e->next;
+        }
+    }
+
+    dc->segment = segment;
+    dc->pos = sizeof(DiskSegment);
+    recordAt(dc, (size_t)segment * DISK_SEGMENT_SIZE + dc->pos)->magic = 0;
+    s->seq = ++dc->seq;
+    s->magic = DISK_SEGMENT_MAGIC;
+}
+
+/* Index the records of a segment, return where its last one ends */
+static size_t scanSegment(DiskCache *dc, int segment)
+{
+    size_t base = (size_t)segment * DISK_SEGMENT_SIZE;
+    size_t pos = sizeof(DiskSegment), len;
+    DiskRecord *r;
+
+    while (pos + sizeof(DiskRecord) <= DISK_SEGMENT_SIZE)
+    {
+        r = recordAt(dc, base + pos);
+        len = ALIGN(sizeof(DiskRecord) + (size_t)r->keylen + r->valuelen);
+        if (r->magic != DISK_RECORD_MAGIC || pos + len > DISK_SEGMENT_SIZE)
+            break;
+        indexRecord(dc, base + pos);
+        pos += len;
+    }
+    return pos;
+}
+
+/*
+ * disk_open - map the segment file at path, creating it if needed, and
+ *             rebuild the index from the records it already holds
+ */
+void disk_open(DiskCache *dc, const char *path)
+{
+    size_t size = (size_t)DISK_SEGMENT_SIZE * DISK_NSEGMENTS;
+    DiskSegment *segments[DISK_NSEGMENTS], *s;
+    int order[DISK_NSEGMENTS], n = 0;
+    struct stat st;
+
+    dc->fd = Open(path, O_RDWR | O_CREAT, 0644);
+    Fstat(dc->fd, &st);
+    if (st.st_size < size && ftruncate(dc->fd, size) < 0)
+        unix_error("ftruncate error");
+    dc->base = Mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, dc->fd, 0);
+    memset(dc->buckets, 0, sizeof(dc->buckets));
+    memset(dc->pins, 0, sizeof(dc->pins));
+    Sem_init(&dc->mutex, 0, 1);
+
+    /* Written segments sorted from the oldest */
+    for (int i = 0; i < DISK_NSEGMENTS; i++)
+    {
+        segments[i] = (DiskSegment *)(dc->base + (size_t)i * DISK_SEGMENT_SIZE);
+        if (segments[i]->magic != DISK_SEGMENT_MAGIC)
+            continue;
+        int j = n++;
+        for (; j > 0 && segments[order[j - 1]]->seq > segments[i]->seq; j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+
+    dc->seq = 0;
+    for (int i = 0; i < n; i++)
+    {
+        s = segments[order[i]];
+        dc->segment = order[i];
+        dc->seq = s->seq;
+        dc->pos = scanSegment(dc, order[i]);
+    }
+    if (n == 0)
+        startSegment(dc, 0);
+}
+
+/*
+ * disk_put - append a copy of a node evicted from memory. The copy is made
+ *            outside the lock, the record is found only once indexed.
+ */
+void disk_put(DiskCache *dc, Node *node)
+{
+    size_t len = ALIGN(sizeof(DiskRecord) + node->keylen + node->valuelen);
+    size_t offset;
+    int segment;
+    DiskRecord *r;
+
+    if (dc->base == NULL)
+        return;
+
+    P(&dc->mutex);
+    /* Keep room to mark where the records of the segment end */
+    if (dc->pos + len + sizeof(DiskRecord) > DISK_SEGMENT_SIZE)
+    {
+        int next = (dc->segment + 1) % DISK_NSEGMENTS;
+        if (dc->pins[next] > 0)
+        {
+            /* Still being sent from, drop the node instead */
+            V(&dc->mutex);
+            return;
+        }
+        startSegment(dc, next);
+    }
+    segment = dc->segment;
+    offset = (size_t)segment * DISK_SEGMENT_SIZE + dc->pos;
+    dc->pos += len;
+    recordAt(dc, offset + len)->magic = 0;
+    dc->pins[segment]++;
+    V(&dc->mutex);
+
+    r = recordAt(dc, offset);
+    r->hash = node->hash;
+    r->keylen = node->keylen;
+    r->valuelen = node->valuelen;
+    r->expires = node->expires;
+    r->framed = node->framed;
+    memcpy(r + 1, node->key, node->keylen);
+    memcpy((char *)(r + 1) + node->keylen, node->value, node->valuelen);
+    r->magic = DISK_RECORD_MAGIC;
+
+    P(&dc->mutex);
+    indexRecord(dc, offset);
+    dc->pins[segment]--;
+    V(&dc->mutex);
+}
+
+/*
+ * disk_get - find a fresh record of key and pin its segment, return 0 if
+ *            there is none. The caller sends it and calls disk_release.
+ */
+int disk_get(DiskCache *dc, const char *key, DiskHit *hit)
+{
+    size_t keylen = strlen(key);
+    unsigned int hash = hashKey(key);
+    DiskEntry *e;
+    DiskRecord *r;
+
+    if (dc->base == NULL)
+        return 0;
+
+    P(&dc->mutex);
+    if ((e = *findEntry(dc, key, keylen, hash)) == NULL ||
+        (r = recordAt(dc, e->offset))->expires <= time(NULL))
+    {
+        V(&dc->mutex);
+        return 0;
+    }
+    hit->segment = SEGMENT(e->offset);
+    hit->offset = e->offset + sizeof(DiskRecord) + r->keylen;
+    hit->len = r->valuelen;
+    hit->framed = r->framed;
+    dc->pins[hit->segment]++;
+    V(&dc->mutex);
+    return 1;
+}
+
+/* Send a pinned record to fd without copying it through user space */
+int disk_send(DiskCache *dc, DiskHit *hit, int fd)
+{
+    off_t offset = hit->offset;
+    size_t left = hit->len;
+    ssize_t n;
+
+    while (left > 0)
+    {
+        if ((n = sendfile(fd, dc->fd, &offset, left)) <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        left -= n;
+    }
+    return 0;
+}
+
+void disk_release(DiskCache *dc, DiskHit *hit)
+{
+    P(&dc->mutex);
+    dc->pins[hit->segment]--;
+    V(&dc->mutex);
+}
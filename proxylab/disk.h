@@ -0,0 +1,64 @@
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+/* The file is a ring of segments, each filled by appending records */
+#define DISK_SEGMENT_SIZE (1 << 22)
+#define DISK_NSEGMENTS 16
+#define DISK_NBUCKETS 4096
+#define DISK_SEGMENT_MAGIC 0x5345474du   /* "SEGM" */
+#define DISK_RECORD_MAGIC 0x5245434fu    /* "RECO" */
+
+/* Start of every written segment, seq orders them on startup */
+typedef struct {
+    unsigned int magic;
+    unsigned int pad;
+    unsigned long seq;
+} DiskSegment;
+
+/* Start of every record, followed by the key and the value */
+typedef struct {
+    unsigned int magic;        /* Written last, a torn record has none */
+    unsigned int hash;
+    unsigned int keylen;
+    unsigned int valuelen;
+    long expires;
+    int framed;
+    int pad;
+} DiskRecord;
+
+/* Where the newest record of a key is */
+typedef struct DiskEntry {
+    size_t offset;             /* Of its DiskRecord in the file */
+    unsigned int hash;
+    struct DiskEntry *next;
+} DiskEntry;
+
+/* A record pinned for sending, its segment is not reused until released */
+typedef struct {
+    size_t offset;             /* Of the value in the file */
+    size_t len;
+    int framed;
+    int segment;
+} DiskHit;
+
+typedef struct {
+    int fd;
+    char *base;                /* The whole file mapped shared */
+    DiskEntry *buckets[DISK_NBUCKETS];
+    int segment;               /* Segment being appended to */
+    size_t pos;                /* Next record within it */
+    unsigned long seq;         /* Of the segment being appended to */
+    int pins[DISK_NSEGMENTS];  /* Records being read or written */
+    sem_t mutex;               /* Protects all of the above but base */
+} DiskCache;
+
+void disk_open(DiskCache *dc, const char *path);
+void disk_put(DiskCache *dc, Node *node);
+int disk_get(DiskCache *dc, const char *key, DiskHit *hit);
+int disk_send(DiskCache *dc, DiskHit *hit, int fd);
+void disk_release(DiskCache *dc, DiskHit *hit);
+
+#endif
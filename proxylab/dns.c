@@ -0,0 +1,287 @@
+/*
+ * dns.c - resolver cache for server names
+ *
+ * getaddrinfo blocks, so it only runs on DNS_NRESOLVERS resolver threads.
+ * Answers are cached for DNS_TTL seconds and failures for DNS_NEG_TTL.
+ * An expired answer is still handed out while a resolver refreshes it, so
+ * only the first request for a name ever waits on the resolver. At most
+ * DNS_MAX_ENTRIES names are kept, so arbitrary names from clients can't
+ * grow the table without bound.
+ */
+#include "dns.h"
+#include "cache.h"
+
+/* Hashed like a pool origin, "host:port" */
+static unsigned int hashName(const char *host, const char *port)
+{
+    char name[MAXLINE];
+
+    snprintf(name, sizeof(name), "%s:%s", host, port);
+    return hashKey(name);
+}
+
+/* Unlink the entry *pp points to and free it, caller holds the mutex */
+static void freeEntry(DnsCache *dc, DnsEntry **pp)
+{
+    DnsEntry *e = *pp;
+
+    *pp = e->next;
+    free(e->host);
+    free(e->port);
+    Free(e);
+    dc->nentries--;
+}
+
+/*
+ * Make room for one more entry if the table is full, caller holds the
+ * mutex. All expired entries go, or else the one that expires first.
+ * Entries being resolved are still used by a resolver and stay, return
+ * 0 if there is no room because of them.
+ */
+static int makeRoom(DnsCache *dc, time_t now)
+{
+    DnsEntry **pp, **first = NULL, *e;
+
+    if (dc->nentries < DNS_MAX_ENTRIES)
+        return 1;
+    for (int i = 0; i < DNS_NBUCKETS; i++)
+    {
+        for (pp = &dc->buckets[i]; (e = *pp) != NULL; )
+        {
+            if (!e->resolving && e->expires <= now)
+            {
+                freeEntry(dc, pp);
+                continue;
+            }
+            if (!e->resolving && (first == NULL || e->expires < (*first)->expires))
+                first = pp;
+            pp = &e->next;
+        }
+    }
+    if (dc->nentries >= DNS_MAX_ENTRIES && first != NULL)
+        freeEntry(dc, first);
+    return dc->nentries < DNS_MAX_ENTRIES;
+}
+
+/* Queue an entry for a resolver, caller holds the mutex */
+static void queueJob(DnsCache *dc, DnsEntry *e)
+{
+    e->resolving = 1;
+    e->nextJob = NULL;
+    *dc->jobsTail = e;
+    dc->jobsTail = &e->nextJob;
+    V(&dc->njobs);
+}
+
+static void* resolver(void *vargp)
+{
+    DnsCache *dc = vargp;
+    struct addrinfo hints, *listp, *p;
+    DnsAnswer answer;
+    DnsWaiter *w, *next;
+    DnsEntry *e;
+
+    Pthread_detach(pthread_self());
+    while (1)
+    {
+        P(&dc->njobs);
+        P(&dc->mutex);
+        e = dc->jobs;
+        if ((dc->jobs = e->nextJob) == NULL)
+            dc->jobsTail = &dc->jobs;
+        V(&dc->mutex);
+
+#ifdef DNS_DELAY_MS
+        /* Pretend the resolver is far away, for benchmarks */
+        usleep(DNS_DELAY_MS * 1000);
+#endif
+        memset(&hints, 0, sizeof(struct addrinfo));
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+        answer.naddrs = 0;
+        if (getaddrinfo(e->host, e->port, &hints, &listp) == 0)
+        {
+            for (p = listp; p && answer.naddrs < DNS_MAX_ADDRS; p = p->ai_next)
+            {
+                DnsAddr *a = &answer.addrs[answer.naddrs++];
+                a->family = p->ai_family;
+                a->len = p->ai_addrlen;
+                memcpy(&a->addr, p->ai_addr, p->ai_addrlen);
+            }
+            freeaddrinfo(listp);
+        }
+
+        /* Waiters are told under the mutex, so one that cancelWaiter
+           doesn't find has been told */
+        P(&dc->mutex);
+        e->answer = answer;
+        e->expires = time(NULL) + (answer.naddrs ? DNS_TTL : DNS_NEG_TTL);
+        e->resolving = 0;
+        for (w = e->waiters; w != NULL; w = next)
+        {
+            next = w->next;
+            w->done(w->arg);
+            Free(w);
+        }
+        e->waiters = NULL;
+        V(&dc->mutex);
+    }
+    return NULL;
+}
+
+void dns_init(DnsCache *dc)
+{
+    pthread_t tid;
+
+    memset(dc->buckets, 0, sizeof(dc->buckets));
+    dc->jobs = NULL;
+    dc->jobsTail = &dc->jobs;
+    dc->nentries = 0;
+    Sem_init(&dc->mutex, 0, 1);
+    Sem_init(&dc->njobs, 0, 0);
+    for (int i = 0; i < DNS_NRESOLVERS; i++)
+        Pthread_create(&tid, NULL, resolver, dc);
+}
+
+/*
+ * dns_resolve - copy a usable answer for host and port into answer and
+ *               return 1, refreshing it in the background if it expired.
+ *               Without one, return 0 and call done(arg) from a resolver
+ *               thread once there is. A new name that finds the table
+ *               full of names being resolved gets an empty answer.
+ */
+int dns_resolve(DnsCache *dc, const char *host, const char *port,
+                DnsAnswer *answer, void (*done)(void *arg), void *arg)
+{
+    unsigned int hash = hashName(host, port);
+    DnsEntry *e;
+    DnsWaiter *w;
+    time_t now = time(NULL);
+
+    P(&dc->mutex);
+    for (e = dc->buckets[hash % DNS_NBUCKETS]; e != NULL; e = e->next)
+        if (e->hash == hash && !strcmp(e->host, host) && !strcmp(e->port, port))
+            break;
+    if (e == NULL)
+    {
+        if (!makeRoom(dc, now))
+        {
+            V(&dc->mutex);
+            answer->naddrs = 0;
+            return 1;
+        }
+        e = Calloc(1, sizeof(DnsEntry));
+        e->host = strdup(host);
+        e->port = strdup(port);
+        e->hash = hash;
+        e->next = dc->buckets[hash % DNS_NBUCKETS];
+        dc->buckets[hash % DNS_NBUCKETS] = e;
+        dc->nentries++;
+    }
+
+    /* Fresh, or stale but known to resolve */
+    if (e->expires > now || (e->expires > 0 && e->answer.naddrs > 0))
+    {
+        *answer = e->answer;
+        if (e->expires <= now && !e->resolving)
+            queueJob(dc, e);
+        V(&dc->mutex);
+        return 1;
+    }
+
+    w = Malloc(sizeof(DnsWaiter));
+    w->done = done;
+    w->arg = arg;
+    w->next = e->waiters;
+    e->waiters = w;
+    if (!e->resolving)
+        queueJob(dc, e);
+    V(&dc->mutex);
+    return 0;
+}
+
+static void postDone(void *arg)
+{
+    V((sem_t *)arg);
+}
+
+/* Forget the waiter for host and port with arg, if it wasn't told yet */
+static void cancelWaiter(DnsCache *dc, const char *host, const char *port,
+                         void *arg)
+{
+    unsigned int hash = hashName(host, port);
+    DnsWaiter **pp, *w;
+    DnsEntry *e;
+
+    P(&dc->mutex);
+    for (e = dc->buckets[hash % DNS_NBUCKETS]; e != NULL; e = e->next)
+        if (e->hash == hash && !strcmp(e->host, host) && !strcmp(e->port, port))
+            break;
+    for (pp = e != NULL ? &e->waiters : NULL; pp != NULL && (w = *pp) != NULL;
+         pp = &w->next)
+    {
+        if (w->arg == arg)
+        {
+            *pp = w->next;
+            Free(w);
+            break;
+        }
+    }
+    V(&dc->mutex);
+}
+
+/*
+ * dns_lookup - resolve host and port, waiting for a resolver if nothing
+ *              is cached, but if dl is not NULL only until it expires.
+ *              Return the number of addresses, 0 if it expired.
+ */
+int dns_lookup(DnsCache *dc, const char *host, const char *port,
+               DnsAnswer *answer, Deadline *dl)
+{
+    sem_t done;
+
+    Sem_init(&done, 0, 0);
+    while (!dns_resolve(dc, host, port, answer, postDone, &done))
+    {
+        if (dl == NULL)
+            P(&done);
+        else if (deadline_wait(dl, &done))
+        {
+            /* Nobody may post done once it is gone */
+            cancelWaiter(dc, host, port, &done);
+            answer->naddrs = 0;
+            break;
+        }
+    }
+    sem_destroy(&done);
+    return answer->naddrs;
+}
+
+/*
+ * dns_connect - like open_clientfd, but with the address from the cache.
+ *               Return -1 if the name does not resolve or no address takes
+ *               the connection. If dl is not NULL, it bounds the wait for
+ *               a resolver, is moved to each socket tried and stays on the
+ *               one returned.
+ */
+int dns_connect(DnsCache *dc, const char *host, const char *port, Deadline *dl)
+{
+    DnsAnswer answer;
+    int fd;
+
+    dns_lookup(dc, host, port, &answer, dl);
+    for (int i = 0; i < answer.naddrs; i++)
+    {
+        if ((fd = socket(answer.addrs[i].family, SOCK_STREAM, 0)) < 0)
+            continue;
+        /* A connect under way is aborted when the deadline expires, one
+           not yet started would not be */
+        if ((dl == NULL || !deadline_watch(dl, fd)) &&
+            connect(fd, (SA *)&answer.addrs[i].addr, answer.addrs[i].len) == 0)
+            return fd;
+        if (dl != NULL)
+            deadline_watch(dl, -1);
+        close(fd);
+    }
+    return -1;
+}
@@ -0,0 +1,61 @@
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include "csapp.h"
+#include "timer.h"
+
+#define DNS_NBUCKETS 64
+#define DNS_NRESOLVERS 2
+#define DNS_MAX_ADDRS 4
+#define DNS_TTL 60      /* getaddrinfo has no TTLs, answers are kept this long */
+#define DNS_NEG_TTL 5   /* Names that did not resolve */
+#define DNS_MAX_ENTRIES 1024  /* Names kept, expired ones make room first */
+
+typedef struct {
+    int family;
+    socklen_t len;
+    struct sockaddr_storage addr;
+} DnsAddr;
+
+/* Addresses of a name, none if it does not resolve */
+typedef struct {
+    int naddrs;
+    DnsAddr addrs[DNS_MAX_ADDRS];
+} DnsAnswer;
+
+/* Someone to tell once the name is resolved */
+typedef struct DnsWaiter {
+    void (*done)(void *arg);
+    void *arg;
+    struct DnsWaiter *next;
+} DnsWaiter;
+
+typedef struct DnsEntry {
+    char *host;
+    char *port;
+    unsigned int hash;
+    DnsAnswer answer;
+    time_t expires;            /* 0 until first resolved */
+    int resolving;             /* Queued for or being resolved */
+    DnsWaiter *waiters;
+    struct DnsEntry *next;     /* Next entry in the same bucket */
+    struct DnsEntry *nextJob;  /* Next entry to resolve */
+} DnsEntry;
+
+/* Resolved names hashed by host and port, resolved by resolver threads */
+typedef struct {
+    DnsEntry *buckets[DNS_NBUCKETS];
+    DnsEntry *jobs, **jobsTail;
+    int nentries;
+    sem_t mutex;               /* Protects all of the above */
+    sem_t njobs;               /* Counts queued jobs */
+} DnsCache;
+
+void dns_init(DnsCache *dc);
+int dns_resolve(DnsCache *dc, const char *host, const char *port,
+                DnsAnswer *answer, void (*done)(void *arg), void *arg);
+int dns_lookup(DnsCache *dc, const char *host, const char *port,
+               DnsAnswer *answer, Deadline *dl);
+int dns_connect(DnsCache *dc, const char *host, const char *port, Deadline *dl);
+
+#endif
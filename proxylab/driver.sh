@@ -32,14 +32,18 @@ BASIC_LIST="home.html
             godzilla.jpg
             tiny"
 
-# List of text files for the cache test
+# List of text and binary files for the cache test
 CACHE_LIST="tiny.c
             home.html
-            csapp.c"
+            csapp.c
+            godzilla.jpg"
 
 # The file we will fetch for various tests
 FETCH_FILE="home.html"
 
+# The binary file we will fetch from the cache
+BINARY_FETCH_FILE="godzilla.jpg"
+
 #####
 # Helper functions
 #
@@ -393,6 +397,17 @@ else
     echo "Failure: Was not able to fetch tiny/${FETCH_FILE} from the proxy cache."
 fi
 
+# Binary objects must come back from the cache byte for byte
+echo "Fetching a cached copy of ./tiny/${BINARY_FETCH_FILE} into ${NOPROXY_DIR}"
+download_proxy $NOPROXY_DIR ${BINARY_FETCH_FILE} "http://localhost:${tiny_port}/${BINARY_FETCH_FILE}" "http://localhost:${proxy_port}"
+diff -q ./tiny/${BINARY_FETCH_FILE} ${NOPROXY_DIR}/${BINARY_FETCH_FILE}  &> /dev/null
+if [ $? -eq 0 ]; then
+    echo "Success: Was able to fetch tiny/${BINARY_FETCH_FILE} from the cache."
+else
+    cacheScore=0
+    echo "Failure: Was not able to fetch tiny/${BINARY_FETCH_FILE} from the proxy cache."
+fi
+
 # Kill the proxy
 echo "Killing proxy"
 kill $proxy_pid 2> /dev/null
@@ -0,0 +1,681 @@
+/*
+ * event.c - event-driven front end for the proxy
+ *
+ * Each event loop owns an epoll instance and drives non-blocking client
+ * and upstream sockets through a per-connection state machine, so a slow
+ * peer never blocks a thread. All loops share the listening socket.
+ * Server names are resolved by the resolver threads of dns.c, which hand
+ * the connection back to its loop through the loop's eventfd.
+ *
+ * Every connection has a timer on its loop's wheel, which the loop runs
+ * between batches of events. The request head must arrive within
+ * CLIENT_TIMEOUT_MS, the server may stay silent UPSTREAM_TIMEOUT_MS at a
+ * time, and a client being sent a page may stop reading as long as
+ * CLIENT_TIMEOUT_MS. An expired connection is closed, or told 408 or 504
+ * when it is still waiting for its answer.
+ */
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "csapp.h"
+#include "cache.h"
+#include "event.h"
+#include "alog.h"
+#include "stats.h"
+#include "http.h"
+#include "proxy.h"
+
+#define MAXEVENTS 64
+
+typedef enum {
+    READ_REQUEST,       /* Reading request line and headers from client */
+    RESOLVE_UPSTREAM,   /* Waiting for a resolver to find the server */
+    CONNECT_UPSTREAM,   /* Waiting for non-blocking connect to finish */
+    WRITE_UPSTREAM,     /* Sending the request to the server */
+    RELAY_RESPONSE,     /* Copying the response from server to client */
+    SEND_CACHED,        /* Sending a cached object to client */
+    SEND_PAGE           /* Sending an error or stats page, then close */
+} ConnState;
+
+typedef struct Conn Conn;
+typedef struct Loop Loop;
+
+/* epoll data points to an endpoint, which points back to its connection */
+typedef struct {
+    int fd;
+    unsigned int events;    /* Registered interest, 0 if not in epoll */
+    Conn *conn;
+} Endpoint;
+
+struct Conn {
+    Timer timer;                    /* First, the timer is the connection */
+    ConnState state;
+    Endpoint client;
+    Endpoint upstream;
+    char in[MAXLINE];               /* Request head from client */
+    size_t inlen;
+    HttpRequest req;                /* Parsed as it arrives, views into in */
+    char out[2 * MAXBUF];           /* Bytes pending for the other side */
+    size_t outlen, outpos;
+    char *key;                      /* Request line, the cache key */
+    Fill fill;                      /* Copy of the response for the cache */
+    HttpResponse res;               /* How far the response got */
+    Node *node;                     /* Cached object being sent */
+    size_t sent;
+    char hostname[MAXLINE];         /* Server to connect to */
+    char port[MAXLINE];
+    DnsAnswer answer;               /* Its addresses */
+    int addr;                       /* Next address to try */
+    Loop *loop;
+    AccessRecord log;
+    int timeout;                    /* Length of the current deadline */
+    int progress;                   /* Events since it was armed */
+    int resolving;                  /* A resolver thread will hand it back */
+    int closed;
+    Conn *nextClosed;
+    Conn *nextResolved;
+    Conn *nextExpired;
+};
+
+struct Loop {
+    int epfd;
+    int listenfd;
+    Endpoint wake;                  /* eventfd written by resolver threads */
+    Conn *resolved;                 /* Handed back by resolver threads */
+    sem_t mutex;                    /* Protects resolved */
+    Conn *closed;                   /* Freed after each batch of events */
+    TimerWheel timers;              /* Deadlines, run after each batch */
+    Conn *expired;                  /* Whose timers fired */
+};
+
+static void handle_client(Loop *loop, Conn *c);
+static void handle_upstream(Loop *loop, Conn *c);
+
+static void set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        unix_error("fcntl error");
+}
+
+/*
+ * watch - register, change or drop (events == 0) interest in an endpoint.
+ *         Dropped endpoints are removed from epoll so that a hangup is not
+ *         reported over and over while we are not interested.
+ */
+static void watch(Loop *loop, Endpoint *ep, unsigned int events)
+{
+    struct epoll_event ev;
+    int op;
+
+    if (events == ep->events)
+        return;
+    if (events == 0)
+        op = EPOLL_CTL_DEL;
+    else if (ep->events == 0)
+        op = EPOLL_CTL_ADD;
+    else
+        op = EPOLL_CTL_MOD;
+    ev.events = events;
+    ev.data.ptr = ep;
+    if (epoll_ctl(loop->epfd, op, ep->fd, &ev) < 0)
+        unix_error("epoll_ctl error");
+    ep->events = events;
+}
+
+/* Timer callback, the wheel is locked, leave the rest to expire_conns */
+static void conn_expired(Timer *t)
+{
+    Conn *c = (Conn *)t;
+
+    c->nextExpired = c->loop->expired;
+    c->loop->expired = c;
+}
+
+/* Give the connection ms from now, extended while events keep coming */
+static void set_deadline(Loop *loop, Conn *c, int ms)
+{
+    timer_cancel(&loop->timers, &c->timer);
+    c->timeout = ms;
+    c->progress = 0;
+    timer_add(&loop->timers, &c->timer, ms, conn_expired);
+}
+
+static void close_conn(Loop *loop, Conn *c)
+{
+    if (c->closed)
+        return;
+    c->closed = 1;
+    timer_cancel(&loop->timers, &c->timer);
+    if (c->log.cache == ALOG_MISS)
+        c->log.bytes = c->fill.len;
+    alog_write(&c->log);
+    stats_record(&c->log);
+    close(c->client.fd);
+    if (c->upstream.fd >= 0)
+        close(c->upstream.fd);
+    /* wake_resolved frees it once the resolver is done with it */
+    if (c->resolving)
+        return;
+    c->nextClosed = loop->closed;
+    loop->closed = c;
+}
+
+static void free_conn(Conn *c)
+{
+    if (c->node != NULL)
+        releaseNode(c->node);
+    dropFill(&c->fill);
+    free(c->key);
+    Free(c);
+}
+
+/*
+ * send_pending - write as much of out as the client takes.
+ *                return 1 if drained, 0 if it would block, -1 on error
+ */
+static int send_pending(int fd, const char *buf, size_t len, size_t *pos)
+{
+    ssize_t n;
+
+    while (*pos < len) {
+        if ((n = send(fd, buf + *pos, len - *pos, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        *pos += n;
+    }
+    return 1;
+}
+
+/* Queue an error page for the client, same content as clienterror */
+static void send_error(Loop *loop, Conn *c, char *cause, char *errnum,
+                       char *shortmsg, char *longmsg)
+{
+    c->outlen = snprintf(c->out, sizeof(c->out),
+        "HTTP/1.0 %s %s\r\n"
+        "Content-type: text/html\r\n\r\n"
+        "<html><title>Proxy Error</title><body bgcolor=ffffff>\r\n"
+        "%s: %s\r\n"
+        "<p>%s: %.1024s\r\n"
+        "<hr><em>The Proxy Web server</em>\r\n",
+        errnum, shortmsg, errnum, shortmsg, longmsg, cause);
+    c->outpos = 0;
+    c->log.cache = ALOG_NONE;
+    c->log.status = atoi(errnum);
+    c->state = SEND_PAGE;
+    set_deadline(loop, c, CLIENT_TIMEOUT_MS);
+    watch(loop, &c->client, EPOLLOUT);
+    handle_client(loop, c);
+}
+
+/* Queue the stats page for the client, there is no worker pool to report */
+static void send_stats(Loop *loop, Conn *c)
+{
+    char extra[MAXLINE];
+
+    sprintf(extra, "\"cache_size\":%zu", cacheSize(&proxyCache));
+    c->outlen = stats_page(c->out, sizeof(c->out), extra);
+    c->outpos = 0;
+    c->log.status = 200;
+    c->state = SEND_PAGE;
+    set_deadline(loop, c, CLIENT_TIMEOUT_MS);
+    watch(loop, &c->client, EPOLLOUT);
+    handle_client(loop, c);
+}
+
+/* Try server addresses in turn until a non-blocking connect is under way */
+static void start_connect(Loop *loop, Conn *c)
+{
+    for (; c->addr < c->answer.naddrs; c->addr++) {
+        DnsAddr *a = &c->answer.addrs[c->addr];
+        int fd = socket(a->family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0)
+            continue;
+        if (connect(fd, (SA *)&a->addr, a->len) < 0 &&
+            errno != EINPROGRESS) {
+            close(fd);
+            continue;
+        }
+        c->upstream.fd = fd;
+        c->state = CONNECT_UPSTREAM;
+        watch(loop, &c->upstream, EPOLLOUT);
+        return;
+    }
+    send_error(loop, c, c->key, "502", "Bad Gateway",
+               "Proxy could not connect to the server");
+}
+
+/* Called by a resolver thread, queue the connection for its loop */
+static void resolved(void *arg)
+{
+    Conn *c = arg;
+    Loop *loop = c->loop;
+    uint64_t one = 1;
+
+    P(&loop->mutex);
+    c->nextResolved = loop->resolved;
+    loop->resolved = c;
+    V(&loop->mutex);
+    if (write(loop->wake.fd, &one, sizeof(one)) < 0)
+        unix_error("eventfd write error");
+}
+
+/* Connect to the server once its addresses are known */
+static void resolve_upstream(Loop *loop, Conn *c)
+{
+    c->state = RESOLVE_UPSTREAM;
+    if (!dns_resolve(&dnsCache, c->hostname, c->port, &c->answer, resolved, c)) {
+        c->resolving = 1;
+        return;
+    }
+    if (c->answer.naddrs == 0) {
+        send_error(loop, c, c->hostname, "502", "Bad Gateway",
+                   "Proxy could not resolve the server");
+        return;
+    }
+    c->addr = 0;
+    start_connect(loop, c);
+}
+
+/* Resume the connections whose server names were resolved */
+static void wake_resolved(Loop *loop)
+{
+    uint64_t count;
+    Conn *c;
+
+    if (read(loop->wake.fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        unix_error("eventfd read error");
+    P(&loop->mutex);
+    c = loop->resolved;
+    loop->resolved = NULL;
+    V(&loop->mutex);
+
+    while (c != NULL) {
+        Conn *next = c->nextResolved;
+        c->resolving = 0;
+        if (c->closed) {
+            c->nextClosed = loop->closed;
+            loop->closed = c;
+        } else if (c->state == RESOLVE_UPSTREAM) {
+            /* Not timed out meanwhile */
+            resolve_upstream(loop, c);
+        }
+        c = next;
+    }
+}
+
+/*
+ * build_request - rewrite the client request head into out, with the same
+ *                 headers forward_requesthdrs sends
+ */
+static void build_request(Conn *c, char *method)
+{
+    HttpRequest *req = &c->req;
+    int hasHost = 0;
+
+    c->outlen = snprintf(c->out, sizeof(c->out), "%s %s%.*s HTTP/1.0\r\n", method,
+                         req->path.len > 0 && req->path.p[0] == '/' ? "" : "/",
+                         (int)req->path.len, req->path.p);
+    for (int i = 0; i < req->nheaders; i++) {
+        HttpHeader *h = &req->headers[i];
+        if (http_caseeq(h->name, "Host"))
+            hasHost = 1;
+        if (http_hop_by_hop(h))
+            continue;
+        memcpy(c->out + c->outlen, h->line.p, h->line.len);
+        c->outlen += h->line.len;
+    }
+
+    if (!hasHost)
+        c->outlen += sprintf(c->out + c->outlen, "Host: %s\r\n", c->hostname);
+    c->outlen += sprintf(c->out + c->outlen, "%s%s%s%s", user_agent_hdr,
+                         "Connection: close\r\n",
+                         "Proxy-Connection: close\r\n", "\r\n");
+    c->outpos = 0;
+}
+
+/* The whole request head has arrived, serve it from cache or start a fetch */
+static void process_request(Loop *loop, Conn *c)
+{
+    HttpRequest *req = &c->req;
+    char method[HTTP_MAX_METHOD + 1];
+
+    c->key = Malloc(req->line.len + 1);
+    http_copy(c->key, req->line.len + 1, req->line);
+    alog_request(&c->log, c->key);
+    initFill(&c->fill, c->key);
+
+    if (http_eq(req->uri, STATS_URI)) {
+        send_stats(loop, c);
+        return;
+    }
+
+    /* Check whether the request is cached, send it straight from the cache.
+       A stale copy is fetched again in full and replaced. */
+    if ((c->node = readCache(&proxyCache, c->key)) != NULL && !isFresh(c->node)) {
+        releaseNode(c->node);
+        c->node = NULL;
+    }
+    if (c->node != NULL) {
+        alog_response(&c->log, ALOG_HIT, c->node->value, c->node->valuelen);
+        c->log.bytes = c->node->valuelen;
+        c->sent = 0;
+        c->state = SEND_CACHED;
+        set_deadline(loop, c, CLIENT_TIMEOUT_MS);
+        watch(loop, &c->client, EPOLLOUT);
+        handle_client(loop, c);
+        return;
+    }
+
+    http_copy(method, sizeof(method), req->method);
+    if (!http_caseeq(req->method, "GET")) {
+        send_error(loop, c, method, "501", "Not Implemented",
+                   "Proxy does not implement this method");
+        return;
+    }
+    if (req->host.len == 0) {
+        send_error(loop, c, c->key, "501", "Not Implemented",
+                   "Proxy does not implement this uri");
+        return;
+    }
+    http_copy(c->hostname, sizeof(c->hostname), req->host);
+    if (req->port.len == 0 || http_copy(c->port, sizeof(c->port), req->port) == 0)
+        strcpy(c->port, "80");
+    build_request(c, method);
+    http_response_init(&c->res);
+    c->log.cache = ALOG_MISS;
+
+    /* Resolving, connecting and every silence of the server count */
+    set_deadline(loop, c, UPSTREAM_TIMEOUT_MS);
+    watch(loop, &c->client, 0);
+    resolve_upstream(loop, c);
+}
+
+static void handle_client(Loop *loop, Conn *c)
+{
+    ssize_t n;
+    int rc;
+
+    switch (c->state) {
+    case READ_REQUEST:
+        while (1) {
+            n = recv(c->client.fd, c->in + c->inlen,
+                     sizeof(c->in) - 1 - c->inlen, 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return;
+            if (n <= 0) {
+                close_conn(loop, c);
+                return;
+            }
+            c->inlen += n;
+            rc = http_parse_request(&c->req, c->in, c->inlen, sizeof(c->in) - 1);
+            if (rc > 0) {
+                process_request(loop, c);
+                return;
+            }
+            if (rc == HTTP_TOO_LARGE) {
+                send_error(loop, c, "request", "431",
+                           "Request Header Fields Too Large",
+                           "Request header too large");
+                return;
+            }
+            if (rc == HTTP_BAD) {
+                send_error(loop, c, "request", "400", "Bad Request",
+                           "Proxy could not parse the request");
+                return;
+            }
+        }
+
+    case SEND_CACHED:
+        rc = send_pending(c->client.fd, c->node->value, c->node->valuelen,
+                          &c->sent);
+        if (rc != 0)
+            close_conn(loop, c);
+        return;
+
+    case SEND_PAGE:
+        if (send_pending(c->client.fd, c->out, c->outlen, &c->outpos) != 0)
+            close_conn(loop, c);
+        return;
+
+    case RELAY_RESPONSE:
+        if ((rc = send_pending(c->client.fd, c->out, c->outlen,
+                               &c->outpos)) < 0) {
+            close_conn(loop, c);
+        } else if (rc > 0) {
+            /* Drained, read more from the server */
+            watch(loop, &c->client, 0);
+            watch(loop, &c->upstream, EPOLLIN);
+        }
+        return;
+
+    default:
+        return;
+    }
+}
+
+static void handle_upstream(Loop *loop, Conn *c)
+{
+    ssize_t n;
+    int rc, err;
+    socklen_t len = sizeof(err);
+
+    switch (c->state) {
+    case CONNECT_UPSTREAM:
+        if (getsockopt(c->upstream.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 ||
+            err != 0) {
+            /* Try the next address */
+            watch(loop, &c->upstream, 0);
+            close(c->upstream.fd);
+            c->upstream.fd = -1;
+            c->addr++;
+            start_connect(loop, c);
+            return;
+        }
+        c->state = WRITE_UPSTREAM;
+        c->log.connect = alog_now();
+        /* Fall through */
+
+    case WRITE_UPSTREAM:
+        if ((rc = send_pending(c->upstream.fd, c->out, c->outlen,
+                               &c->outpos)) < 0) {
+            close_conn(loop, c);
+        } else if (rc > 0) {
+            c->state = RELAY_RESPONSE;
+            c->outlen = c->outpos = 0;
+            watch(loop, &c->upstream, EPOLLIN);
+        }
+        return;
+
+    case RELAY_RESPONSE:
+        n = recv(c->upstream.fd, c->out, sizeof(c->out), 0);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0) {
+            /* Cache it only if it arrived whole, and is small enough */
+            if (n == 0 && http_response_complete(&c->res))
+                writeCache(&proxyCache, c->key, &c->fill, 0);
+            close_conn(loop, c);
+            return;
+        }
+
+        if (c->log.firstByte == 0)
+            alog_response(&c->log, ALOG_MISS, c->out, n);
+        http_parse_response(&c->res, c->out, n);
+        appendFill(&c->fill, c->out, n);
+
+        c->outlen = n;
+        c->outpos = 0;
+        if ((rc = send_pending(c->client.fd, c->out, c->outlen,
+                               &c->outpos)) < 0) {
+            close_conn(loop, c);
+        } else if (rc == 0) {
+            /* Client is slow, stop reading until it drains */
+            watch(loop, &c->upstream, 0);
+            watch(loop, &c->client, EPOLLOUT);
+        }
+        return;
+
+    default:
+        return;
+    }
+}
+
+static void accept_conns(Loop *loop)
+{
+    int connfd;
+    Conn *c;
+
+    while ((connfd = accept(loop->listenfd, NULL, NULL)) >= 0) {
+        set_nonblocking(connfd);
+        c = Calloc(1, sizeof(Conn));
+        c->state = READ_REQUEST;
+        http_init(&c->req);
+        c->client.fd = connfd;
+        c->client.conn = c;
+        c->upstream.fd = -1;
+        c->upstream.conn = c;
+        c->loop = loop;
+        alog_start(&c->log, 0);
+        alog_client(&c->log, connfd);
+        set_deadline(loop, c, CLIENT_TIMEOUT_MS);
+        watch(loop, &c->client, EPOLLIN);
+    }
+}
+
+/* The deadline passed without any event, answer the client if it waits */
+static void timed_out(Loop *loop, Conn *c)
+{
+    switch (c->state) {
+    case READ_REQUEST:
+        if (c->inlen == 0) {
+            close_conn(loop, c);
+            return;
+        }
+        send_error(loop, c, "request", "408", "Request Timeout",
+                   "Proxy timed out waiting for the request");
+        return;
+
+    case RESOLVE_UPSTREAM:
+    case CONNECT_UPSTREAM:
+    case WRITE_UPSTREAM:
+    case RELAY_RESPONSE:
+        if (c->log.firstByte != 0) {
+            /* Part of the response went out, it is never cached */
+            close_conn(loop, c);
+            return;
+        }
+        if (c->upstream.fd >= 0) {
+            watch(loop, &c->upstream, 0);
+            close(c->upstream.fd);
+            c->upstream.fd = -1;
+        }
+        send_error(loop, c, c->hostname, "504", "Gateway Timeout",
+                   "Proxy timed out waiting for the server");
+        return;
+
+    default:
+        close_conn(loop, c);
+        return;
+    }
+}
+
+/* Handle the connections whose timers fired, extending those with events */
+static void expire_conns(Loop *loop)
+{
+    Conn *c;
+
+    while ((c = loop->expired) != NULL) {
+        loop->expired = c->nextExpired;
+        if (c->progress)
+            set_deadline(loop, c, c->timeout);
+        else
+            timed_out(loop, c);
+    }
+}
+
+static void* event_loop(void *vargp)
+{
+    Loop *loop = vargp;
+    struct epoll_event events[MAXEVENTS];
+    Endpoint *ep;
+    Conn *c;
+    int n;
+
+    while (1) {
+        n = epoll_wait(loop->epfd, events, MAXEVENTS, timer_next(&loop->timers));
+        if (n < 0) {
+            if (errno != EINTR)
+                unix_error("epoll_wait error");
+            n = 0;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if ((ep = events[i].data.ptr) == NULL) {
+                accept_conns(loop);
+                continue;
+            }
+            if (ep == &loop->wake) {
+                wake_resolved(loop);
+                continue;
+            }
+            c = ep->conn;
+            if (c->closed)
+                continue;
+            /* The head must arrive in time, anything later is extended */
+            if (c->state != READ_REQUEST)
+                c->progress = 1;
+            if (ep == &c->client)
+                handle_client(loop, c);
+            else
+                handle_upstream(loop, c);
+        }
+        timer_run(&loop->timers);
+        expire_conns(loop);
+
+        /* No events of this batch refer to them any more */
+        while ((c = loop->closed) != NULL) {
+            loop->closed = c->nextClosed;
+            free_conn(c);
+        }
+    }
+    return NULL;
+}
+
+void start_event_loops(int listenfd, int nloops)
+{
+    struct epoll_event ev;
+    pthread_t tid;
+    Loop *loops;
+
+    if (nloops < 1)
+        nloops = 1;
+    set_nonblocking(listenfd);
+    loops = Calloc(nloops, sizeof(Loop));
+    for (int i = 0; i < nloops; i++) {
+        if ((loops[i].epfd = epoll_create1(0)) < 0)
+            unix_error("epoll_create1 error");
+        loops[i].listenfd = listenfd;
+
+        /* Wake only one loop per incoming connection */
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+            unix_error("epoll_ctl error");
+
+        if ((loops[i].wake.fd = eventfd(0, EFD_NONBLOCK)) < 0)
+            unix_error("eventfd error");
+        Sem_init(&loops[i].mutex, 0, 1);
+        timer_setup(&loops[i].timers);
+        watch(&loops[i], &loops[i].wake, EPOLLIN);
+    }
+
+    for (int i = 1; i < nloops; i++)
+        Pthread_create(&tid, NULL, event_loop, &loops[i]);
+    event_loop(&loops[0]);
+}
@@ -0,0 +1,9 @@
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+#include "csapp.h"
+
+/* Run nloops epoll event loops sharing listenfd, never returns */
+void start_event_loops(int listenfd, int nloops);
+
+#endif
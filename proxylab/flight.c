@@ -0,0 +1,84 @@
+#include "flight.h"
+#include "cache.h"
+
+static void putFlight(FlightTable *table, Flight *flight)
+{
+    P(&table->mutex);
+    if (--flight->refcnt > 0)
+    {
+        V(&table->mutex);
+        return;
+    }
+    V(&table->mutex);
+    free(flight->key);
+    free(flight);
+}
+
+void initFlights(FlightTable *table)
+{
+    memset(table->buckets, 0, sizeof(table->buckets));
+    Sem_init(&table->mutex, 0, 1);
+}
+
+/*
+ * joinFlight - join the fetch in flight for key, or start one.
+ *              *leader is set if the caller must fetch and then call
+ *              landFlight, otherwise the caller calls waitFlight.
+ */
+Flight* joinFlight(FlightTable *table, const char *key, int *leader)
+{
+    unsigned int hash = hashKey(key);
+    Flight **bucket = &table->buckets[hash % FLIGHT_NBUCKETS];
+    Flight *p;
+
+    P(&table->mutex);
+    for (p = *bucket; p != NULL; p = p->next)
+    {
+        if (p->hash == hash && strcmp(p->key, key) == 0)
+        {
+            p->refcnt++;
+            p->nwaiters++;
+            V(&table->mutex);
+            *leader = 0;
+            return p;
+        }
+    }
+
+    p = Malloc(sizeof(Flight));
+    p->key = strdup(key);
+    p->hash = hash;
+    p->refcnt = 1;
+    p->nwaiters = 0;
+    Sem_init(&p->done, 0, 0);
+    p->next = *bucket;
+    *bucket = p;
+    V(&table->mutex);
+    *leader = 1;
+    return p;
+}
+
+/* Block until the leader has fetched the object */
+void waitFlight(FlightTable *table, Flight *flight)
+{
+    P(&flight->done);
+    putFlight(table, flight);
+}
+
+/* The fetch is over and cached if it could be, wake the waiters */
+void landFlight(FlightTable *table, Flight *flight)
+{
+    Flight **pp;
+    int n;
+
+    P(&table->mutex);
+    pp = &table->buckets[flight->hash % FLIGHT_NBUCKETS];
+    while (*pp != flight)
+        pp = &(*pp)->next;
+    *pp = flight->next;
+    n = flight->nwaiters;
+    V(&table->mutex);
+
+    while (n-- > 0)
+        V(&flight->done);
+    putFlight(table, flight);
+}
@@ -0,0 +1,29 @@
+#ifndef __FLIGHT_H__
+#define __FLIGHT_H__
+
+#include "csapp.h"
+
+#define FLIGHT_NBUCKETS 64
+
+/* A fetch from the server that other requests for the same key wait on */
+typedef struct Flight {
+    char *key;                 /* Request line */
+    unsigned int hash;
+    int refcnt;                /* Leader and waiters */
+    int nwaiters;
+    sem_t done;                /* Posted once per waiter when it lands */
+    struct Flight *next;
+} Flight;
+
+/* In-flight fetches hashed by request line */
+typedef struct {
+    Flight *buckets[FLIGHT_NBUCKETS];
+    sem_t mutex;               /* Protects buckets and reference counts */
+} FlightTable;
+
+void initFlights(FlightTable *table);
+Flight* joinFlight(FlightTable *table, const char *key, int *leader);
+void waitFlight(FlightTable *table, Flight *flight);
+void landFlight(FlightTable *table, Flight *flight);
+
+#endif
@@ -0,0 +1,490 @@
+/*
+ * http.c - incremental HTTP request head parser
+ *
+ * http_parse_request looks at every byte once. Given more of the same input
+ * it resumes where it stopped, even if the input was moved meanwhile, since
+ * everything is kept as offsets until the head is complete. The request
+ * line, the URI and the headers are then views into the input, nothing is
+ * copied or allocated.
+ *
+ * http_parse_response only follows how a response is framed, as the pieces
+ * of it stream past, to tell whether the whole body arrived.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "http.h"
+
+enum {
+    S_METHOD,
+    S_URI,
+    S_VERSION,
+    S_LINE_LF,
+    S_HEADER,
+    S_NAME,
+    S_VALUE_START,
+    S_VALUE,
+    S_HEADER_LF,
+    S_END_LF
+};
+
+/* Where http_parse_response is in a response */
+enum {
+    R_HEAD,
+    R_BODY,
+    R_CHUNK_SIZE,
+    R_CHUNK_DATA,
+    R_CHUNK_END,
+    R_TRAILER,
+    R_UNTIL_CLOSE,
+    R_DONE,
+    R_BAD
+};
+
+/* Token characters of RFC 7230 as a bitmap of the 128 ASCII characters */
+static const unsigned long long tchars[2] = {
+    0x03ff6cfa00000000ULL, 0x57ffffffc7fffffeULL
+};
+
+static inline int isTchar(unsigned char c)
+{
+    return c < 128 && (tchars[c >> 6] >> (c & 63)) & 1;
+}
+
+static inline void setSlice(HttpSlice *s, size_t start, size_t end)
+{
+    s->off = start;
+    s->len = end - start;
+}
+
+static inline void resolve(HttpSlice *s, const char *buf)
+{
+    s->p = buf + s->off;
+}
+
+/* Split an absolute http:// URI into host, port and path */
+static void parseUri(HttpRequest *req, const char *buf)
+{
+    const char *uri = buf + req->uri.off, *end = uri + req->uri.len;
+    const char *p, *host, *hostEnd;
+
+    req->host.len = req->port.len = req->path.len = 0;
+    req->host.off = req->port.off = req->path.off = req->uri.off;
+    if (req->uri.len > 0 && uri[0] == '/')
+    {
+        req->path = req->uri;
+        return;
+    }
+    if (req->uri.len < 7 || strncasecmp(uri, "http://", 7))
+        return;
+
+    host = p = uri + 7;
+    if (p < end && *p == '[')
+    {
+        /* IPv6 literal, the brackets are not part of the host */
+        host = ++p;
+        while (p < end && *p != ']')
+            p++;
+        if (p == end)
+            return;
+        hostEnd = p++;
+    }
+    else
+    {
+        while (p < end && *p != ':' && *p != '/' && *p != '?')
+            p++;
+        hostEnd = p;
+    }
+    if (hostEnd == host)
+        return;
+
+    if (p < end && *p == ':')
+    {
+        const char *port = ++p;
+        while (p < end && *p >= '0' && *p <= '9')
+            p++;
+        if (p == port || p - port > 5)
+            return;
+        setSlice(&req->port, port - buf, p - buf);
+    }
+    if (p < end && *p != '/' && *p != '?')
+    {
+        req->port.len = 0;
+        return;
+    }
+    setSlice(&req->host, host - buf, hostEnd - buf);
+    setSlice(&req->path, p - buf, end - buf);
+}
+
+/* The head is complete, point the views into buf */
+static void finish(HttpRequest *req, const char *buf)
+{
+    resolve(&req->line, buf);
+    resolve(&req->method, buf);
+    resolve(&req->uri, buf);
+    resolve(&req->version, buf);
+    parseUri(req, buf);
+    resolve(&req->host, buf);
+    resolve(&req->port, buf);
+    resolve(&req->path, buf);
+    for (int i = 0; i < req->nheaders; i++)
+    {
+        resolve(&req->headers[i].name, buf);
+        resolve(&req->headers[i].value, buf);
+        resolve(&req->headers[i].line, buf);
+    }
+}
+
+void http_init(HttpRequest *req)
+{
+    req->state = S_METHOD;
+    req->pos = req->mark = req->end = 0;
+    req->nheaders = 0;
+}
+
+/*
+ * http_parse_request - parse the request head at the start of the len bytes
+ *     of buf, which begin with whatever was passed before. Return the
+ *     length of the head once complete, HTTP_INCOMPLETE if more input is
+ *     needed, HTTP_BAD if it is malformed and HTTP_TOO_LARGE if it does not
+ *     fit in max bytes or has too many headers.
+ */
+int http_parse_request(HttpRequest *req, const char *buf, size_t len, size_t max)
+{
+    size_t pos = req->pos;
+    unsigned char c;
+    HttpHeader *h;
+
+    if (len > max)
+        len = max;
+    for (; pos < len; pos++)
+    {
+        c = buf[pos];
+        switch (req->state)
+        {
+        case S_METHOD:
+            if (c == ' ' && pos > 0)
+            {
+                setSlice(&req->method, 0, pos);
+                req->mark = pos + 1;
+                req->state = S_URI;
+            }
+            else if (!isTchar(c) || pos >= HTTP_MAX_METHOD)
+                return HTTP_BAD;
+            break;
+
+        case S_URI:
+            /* Scan the URI in one go, it is most of the line */
+            while (c > ' ' && c < 0x7f && ++pos < len)
+                c = buf[pos];
+            if (pos == len)
+                goto more;
+            if (c != ' ' || pos == req->mark)
+                return HTTP_BAD;
+            setSlice(&req->uri, req->mark, pos);
+            req->mark = pos + 1;
+            req->state = S_VERSION;
+            break;
+
+        case S_VERSION:
+            if (c != '\r' && c != '\n')
+            {
+                if (pos - req->mark >= 8)
+                    return HTTP_BAD;
+                break;
+            }
+            setSlice(&req->version, req->mark, pos);
+            if (req->version.len != 8 || memcmp(buf + req->mark, "HTTP/1.", 7) ||
+                buf[pos - 1] < '0' || buf[pos - 1] > '9')
+                return HTTP_BAD;
+            req->minor = buf[pos - 1] - '0';
+            if (c == '\r')
+            {
+                req->state = S_LINE_LF;
+                break;
+            }
+            /* Fall through */
+        case S_LINE_LF:
+            if (c != '\n')
+                return HTTP_BAD;
+            setSlice(&req->line, 0, pos + 1);
+            req->state = S_HEADER;
+            break;
+
+        case S_HEADER:
+            req->mark = pos;
+            if (c == '\r')
+                req->state = S_END_LF;
+            else if (c == '\n')
+                goto done;
+            else if (isTchar(c))
+                req->state = S_NAME;
+            else
+                return HTTP_BAD;  /* Folded lines are obsolete, refuse them */
+            break;
+
+        case S_NAME:
+            while (isTchar(c) && ++pos < len)
+                c = buf[pos];
+            if (pos == len)
+                goto more;
+            if (c == ':')
+            {
+                if (req->nheaders == HTTP_MAX_HEADERS)
+                    return HTTP_TOO_LARGE;
+                h = &req->headers[req->nheaders];
+                setSlice(&h->line, req->mark, req->mark);
+                setSlice(&h->name, req->mark, pos);
+                req->state = S_VALUE_START;
+            }
+            else if (!isTchar(c))
+                return HTTP_BAD;
+            break;
+
+        case S_VALUE_START:
+            if (c == ' ' || c == '\t')
+                break;
+            req->end = pos;
+            h = &req->headers[req->nheaders];
+            setSlice(&h->value, pos, pos);
+            req->state = S_VALUE;
+            /* Fall through */
+        case S_VALUE:
+            while ((c >= ' ' && c != 0x7f) || c == '\t' || c >= 0x80)
+            {
+                if (c != ' ' && c != '\t')
+                    req->end = pos + 1;
+                if (++pos == len)
+                    goto more;
+                c = buf[pos];
+            }
+            h = &req->headers[req->nheaders];
+            h->value.len = req->end - h->value.off;
+            if (c == '\r')
+            {
+                req->state = S_HEADER_LF;
+                break;
+            }
+            /* Fall through */
+        case S_HEADER_LF:
+            if (c != '\n')
+                return HTTP_BAD;
+            h = &req->headers[req->nheaders++];
+            h->line.len = pos + 1 - h->line.off;
+            req->state = S_HEADER;
+            break;
+
+        case S_END_LF:
+            if (c != '\n')
+                return HTTP_BAD;
+            goto done;
+        }
+    }
+
+more:
+    req->pos = pos;
+    return len >= max ? HTTP_TOO_LARGE : HTTP_INCOMPLETE;
+
+done:
+    req->pos = pos + 1;
+    finish(req, buf);
+    return pos + 1;
+}
+
+/* First header called name, ignoring case, NULL if there is none */
+HttpHeader* http_header(HttpRequest *req, const char *name)
+{
+    for (int i = 0; i < req->nheaders; i++)
+        if (http_caseeq(req->headers[i].name, name))
+            return &req->headers[i];
+    return NULL;
+}
+
+int http_eq(HttpSlice s, const char *str)
+{
+    return strlen(str) == s.len && !memcmp(s.p, str, s.len);
+}
+
+int http_caseeq(HttpSlice s, const char *str)
+{
+    return strlen(str) == s.len && !strncasecmp(s.p, str, s.len);
+}
+
+/* Whether the value contains token, ignoring case */
+int http_has_token(HttpSlice s, const char *token)
+{
+    size_t len = strlen(token);
+
+    for (size_t i = 0; i + len <= s.len; i++)
+        if (!strncasecmp(s.p + i, token, len))
+            return 1;
+    return 0;
+}
+
+/* Copy s to dst as a string, cut to fit size, return its length */
+size_t http_copy(char *dst, size_t size, HttpSlice s)
+{
+    size_t n = s.len < size - 1 ? s.len : size - 1;
+
+    memcpy(dst, s.p, n);
+    dst[n] = '\0';
+    return n;
+}
+
+/* Whether a header only concerns this hop, and is not to be forwarded */
+int http_hop_by_hop(HttpHeader *h)
+{
+    return http_caseeq(h->name, "Connection") ||
+           http_caseeq(h->name, "Proxy-Connection") ||
+           http_caseeq(h->name, "Keep-Alive");
+}
+
+/* Whether the client wants to keep the connection after this request */
+int http_keepalive(HttpRequest *req)
+{
+    int keepalive = req->minor >= 1;
+
+    for (int i = 0; i < req->nheaders; i++)
+    {
+        HttpHeader *h = &req->headers[i];
+        if (!http_caseeq(h->name, "Connection") &&
+            !http_caseeq(h->name, "Proxy-Connection"))
+            continue;
+        if (http_has_token(h->value, "close"))
+            keepalive = 0;
+        else if (http_has_token(h->value, "keep-alive"))
+            keepalive = 1;
+    }
+    return keepalive;
+}
+
+void http_response_init(HttpResponse *res)
+{
+    res->state = R_HEAD;
+    res->status = 0;
+    res->lines = 0;
+    res->chunked = 0;
+    res->length = -1;
+    res->left = 0;
+    res->linelen = 0;
+}
+
+/* The head is over, see how the body is framed */
+static void startBody(HttpResponse *res)
+{
+    if (res->status / 100 == 1)
+    {
+        /* An interim response, the real one follows */
+        http_response_init(res);
+        return;
+    }
+    if (res->status == 204 || res->status == 304)
+        res->state = R_DONE;
+    else if (res->chunked)
+        res->state = R_CHUNK_SIZE;
+    else if (res->length >= 0)
+        res->state = (res->left = res->length) > 0 ? R_BODY : R_DONE;
+    else
+        res->state = R_UNTIL_CLOSE;
+}
+
+/* A head, chunk size or trailer line ended, its start is in res->line */
+static void endLine(HttpResponse *res)
+{
+    const char *line = res->line;
+    int blank = !strcmp(line, "\r\n") || !strcmp(line, "\n");
+    HttpSlice value;
+    char *end;
+
+    switch (res->state)
+    {
+    case R_HEAD:
+        if (res->lines++ == 0)
+        {
+            if (strncmp(line, "HTTP/", 5) || (end = strchr(line, ' ')) == NULL)
+                res->state = R_BAD;
+            else
+                res->status = atoi(end);
+        }
+        else if (blank)
+            startBody(res);
+        else if (!strncasecmp(line, "Content-Length:", 15))
+            res->length = strtoll(line + 15, NULL, 10);
+        else if (!strncasecmp(line, "Transfer-Encoding:", 18))
+        {
+            value.p = line + 18;
+            value.len = strlen(value.p);
+            res->chunked = http_has_token(value, "chunked");
+        }
+        return;
+
+    case R_CHUNK_SIZE:
+        res->left = strtoll(line, &end, 16);
+        if (end == line || res->left < 0)
+            res->state = R_BAD;
+        else
+            res->state = res->left > 0 ? R_CHUNK_DATA : R_TRAILER;
+        return;
+
+    case R_CHUNK_END:
+        res->state = blank ? R_CHUNK_SIZE : R_BAD;
+        return;
+
+    case R_TRAILER:
+        if (blank)
+            res->state = R_DONE;
+        return;
+    }
+}
+
+/*
+ * http_parse_response - follow the next len bytes of a response. Return 1
+ *     once it is complete, ignoring anything after it, 0 while more is to
+ *     come and HTTP_BAD if its framing is malformed.
+ */
+int http_parse_response(HttpResponse *res, const char *buf, size_t len)
+{
+    const char *end = buf + len, *eol;
+    size_t n, room;
+
+    while (buf < end && res->state != R_DONE && res->state != R_BAD)
+    {
+        switch (res->state)
+        {
+        case R_BODY:
+        case R_CHUNK_DATA:
+            n = (size_t)(end - buf) < (unsigned long long)res->left ?
+                (size_t)(end - buf) : (size_t)res->left;
+            buf += n;
+            if ((res->left -= n) == 0)
+                res->state = res->state == R_BODY ? R_DONE : R_CHUNK_END;
+            break;
+
+        case R_UNTIL_CLOSE:
+            buf = end;
+            break;
+
+        default:
+            /* Gather a line, only its start matters */
+            eol = memchr(buf, '\n', end - buf);
+            n = (eol != NULL ? eol + 1 : end) - buf;
+            room = sizeof(res->line) - 1 - res->linelen;
+            memcpy(res->line + res->linelen, buf, n < room ? n : room);
+            res->linelen += n < room ? n : room;
+            buf += n;
+            if (eol != NULL)
+            {
+                res->line[res->linelen] = '\0';
+                res->linelen = 0;
+                endLine(res);
+            }
+        }
+    }
+    return res->state == R_BAD ? HTTP_BAD : res->state == R_DONE;
+}
+
+/* Whether the response is whole if the server closes the connection now */
+int http_response_complete(HttpResponse *res)
+{
+    return res->state == R_DONE || res->state == R_UNTIL_CLOSE;
+}
@@ -0,0 +1,72 @@
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <stddef.h>
+
+#define HTTP_MAX_HEADERS 64
+#define HTTP_MAX_METHOD 16
+
+/* Results of http_parse_request besides the length of a complete head */
+#define HTTP_INCOMPLETE 0
+#define HTTP_BAD (-1)
+#define HTTP_TOO_LARGE (-2)
+
+/* Bytes of the input, not NUL terminated. off is where they start in the
+   input, p points to them once the head is complete. */
+typedef struct {
+    const char *p;
+    size_t off;
+    size_t len;
+} HttpSlice;
+
+typedef struct {
+    HttpSlice name;
+    HttpSlice value;           /* Without surrounding white space */
+    HttpSlice line;            /* The whole line with its end */
+} HttpHeader;
+
+typedef struct {
+    HttpSlice line;            /* Request line with its end */
+    HttpSlice method;
+    HttpSlice uri;
+    HttpSlice version;
+    int minor;                 /* HTTP/1.minor */
+    HttpSlice host;            /* From an http:// URI, empty otherwise */
+    HttpSlice port;            /* Empty if not given */
+    HttpSlice path;            /* Empty if not given */
+    HttpHeader headers[HTTP_MAX_HEADERS];
+    int nheaders;
+    int state;                 /* Where to resume */
+    size_t pos;                /* Next byte to look at */
+    size_t mark;               /* Start of the element being parsed */
+    size_t end;                /* End of a header value so far */
+} HttpRequest;
+
+/* Follows the framing of a response as it streams past, nothing is kept */
+#define HTTP_MAX_FRAMING_LINE 128
+
+typedef struct {
+    int state;                 /* Where to resume */
+    int status;
+    int lines;                 /* Lines of the head so far */
+    int chunked;
+    long long length;          /* Content-Length, -1 if not given */
+    long long left;            /* Bytes of the body or chunk still to come */
+    char line[HTTP_MAX_FRAMING_LINE];  /* Start of the line being read */
+    size_t linelen;            /* Its length, longer lines are cut */
+} HttpResponse;
+
+void http_init(HttpRequest *req);
+int http_parse_request(HttpRequest *req, const char *buf, size_t len, size_t max);
+HttpHeader* http_header(HttpRequest *req, const char *name);
+int http_eq(HttpSlice s, const char *str);
+int http_caseeq(HttpSlice s, const char *str);
+int http_has_token(HttpSlice s, const char *token);
+size_t http_copy(char *dst, size_t size, HttpSlice s);
+int http_hop_by_hop(HttpHeader *h);
+int http_keepalive(HttpRequest *req);
+void http_response_init(HttpResponse *res);
+int http_parse_response(HttpResponse *res, const char *buf, size_t len);
+int http_response_complete(HttpResponse *res);
+
+#endif
@@ -0,0 +1,226 @@
+/*
+ * httpfuzz.c - fuzz the HTTP request parser
+ *
+ * Every input is parsed whole, then again resumed after every possible
+ * split and a byte at a time, moving the input between calls. All ways must
+ * agree, and the views of a complete head must lie inside it. Inputs are the
+ * files of the corpus, then random mutations of them.
+ *
+ * usage: ./httpfuzz [-n mutations] [-s seed] corpusfile...
+ * Built with -DLIBFUZZER it is a libFuzzer target instead.
+ */
+#include "csapp.h"
+#include "http.h"
+
+#define MAXINPUT (RIO_BUFSIZE + 1024)
+
+static void fail(const char *what, const char *buf, size_t len)
+{
+    fprintf(stderr, "httpfuzz: %s on input of %zu bytes:\n", what, len);
+    fwrite(buf, 1, len, stderr);
+    fputc('\n', stderr);
+    abort();
+}
+
+static void checkSlice(HttpSlice s, const char *buf, size_t head, const char *in, size_t len)
+{
+    if (s.p != buf + s.off || s.off + s.len > head)
+        fail("view outside the head", in, len);
+}
+
+/* Views of a complete head lie inside it and mean what they should */
+static void checkRequest(HttpRequest *req, const char *buf, int head, const char *in, size_t len)
+{
+    checkSlice(req->line, buf, head, in, len);
+    checkSlice(req->method, buf, head, in, len);
+    checkSlice(req->uri, buf, head, in, len);
+    checkSlice(req->version, buf, head, in, len);
+    checkSlice(req->host, buf, head, in, len);
+    checkSlice(req->port, buf, head, in, len);
+    checkSlice(req->path, buf, head, in, len);
+    if (req->method.len == 0 || req->uri.len == 0 || req->version.len != 8)
+        fail("empty request line element", in, len);
+    if (req->line.p[req->line.len - 1] != '\n')
+        fail("request line without its end", in, len);
+    for (int i = 0; i < req->nheaders; i++)
+    {
+        HttpHeader *h = &req->headers[i];
+        checkSlice(h->name, buf, head, in, len);
+        checkSlice(h->value, buf, head, in, len);
+        checkSlice(h->line, buf, head, in, len);
+        if (h->name.len == 0 || h->name.p != h->line.p ||
+            h->line.p[h->line.len - 1] != '\n')
+            fail("bad header view", in, len);
+        if (h->value.len > 0 && (h->value.p[0] == ' ' ||
+                                 h->value.p[h->value.len - 1] == ' '))
+            fail("header value not trimmed", in, len);
+    }
+}
+
+/* The parts of two results that must not depend on how input came in */
+static int sameRequest(HttpRequest *a, HttpRequest *b)
+{
+    if (a->nheaders != b->nheaders || a->uri.off != b->uri.off ||
+        a->uri.len != b->uri.len || a->host.len != b->host.len ||
+        a->path.len != b->path.len || a->minor != b->minor)
+        return 0;
+    for (int i = 0; i < a->nheaders; i++)
+        if (a->headers[i].value.off != b->headers[i].value.off ||
+            a->headers[i].value.len != b->headers[i].value.len)
+            return 0;
+    return 1;
+}
+
+/* Feed in the first split bytes, then all of them, from a moved copy */
+static int parseSplit(HttpRequest *req, const char *in, size_t len, size_t split)
+{
+    static char a[MAXINPUT], b[MAXINPUT];
+    int rc;
+
+    http_init(req);
+    memcpy(a, in, len);
+    if ((rc = http_parse_request(req, a, split, RIO_BUFSIZE)) != HTTP_INCOMPLETE)
+        return rc;
+    memcpy(b, in, len);
+    memset(a, 0, len);
+    rc = http_parse_request(req, b, len, RIO_BUFSIZE);
+    if (rc > 0)
+        checkRequest(req, b, rc, in, len);
+    return rc;
+}
+
+static void checkInput(const char *in, size_t len)
+{
+    static HttpRequest whole, part;
+    static char buf[MAXINPUT];
+    int rc, rc2;
+
+    if (len > MAXINPUT)
+        len = MAXINPUT;
+    http_init(&whole);
+    memcpy(buf, in, len);
+    rc = http_parse_request(&whole, buf, len, RIO_BUFSIZE);
+    if (rc > 0)
+        checkRequest(&whole, buf, rc, in, len);
+    if (rc > (int)len)
+        fail("head longer than the input", in, len);
+
+    for (size_t split = 0; split < len; split++)
+    {
+        rc2 = parseSplit(&part, in, len, split);
+        /* An error may show up before the split, a head never does */
+        if (rc2 != rc && !(rc < 0 && rc2 < 0))
+            fail("resumed parse disagrees", in, len);
+        if (rc > 0 && !sameRequest(&whole, &part))
+            fail("resumed parse has other views", in, len);
+    }
+
+    /* A byte at a time */
+    http_init(&part);
+    for (size_t n = 1; n <= len; n++)
+        if ((rc2 = http_parse_request(&part, in, n, RIO_BUFSIZE)) != HTTP_INCOMPLETE)
+            break;
+    if (len > 0 && rc2 != rc && !(rc < 0 && rc2 < 0))
+        fail("bytewise parse disagrees", in, len);
+}
+
+#ifdef LIBFUZZER
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size)
+{
+    checkInput((const char *)data, size);
+    return 0;
+}
+#else
+static char inputs[64][MAXINPUT];
+static size_t lens[64];
+
+/* Flip, insert, delete or splice bytes, favoring the ones HTTP cares about */
+static size_t mutate(char *buf, size_t len)
+{
+    static const char special[] = " \r\n:\t/[]?\x7f\x80";
+    int n = 1 + rand() % 4;
+
+    while (n--)
+    {
+        size_t at = len ? rand() % len : 0;
+        char c = rand() % 2 ? special[rand() % (sizeof(special) - 1)] : rand();
+        switch (rand() % 4)
+        {
+        case 0:
+            if (len)
+                buf[at] = c;
+            break;
+        case 1:
+            if (len < MAXINPUT)
+            {
+                memmove(buf + at + 1, buf + at, len - at);
+                buf[at] = c;
+                len++;
+            }
+            break;
+        case 2:
+            if (len)
+            {
+                memmove(buf + at, buf + at + 1, len - at - 1);
+                len--;
+            }
+            break;
+        case 3:
+            len = at;
+            break;
+        }
+    }
+    return len;
+}
+
+int main(int argc, char **argv)
+{
+    long mutations = 20000;
+    int opt, ninputs = 0, results[4] = { 0 };
+    char buf[MAXINPUT];
+    FILE *fp;
+
+    srand(1);
+    while ((opt = getopt(argc, argv, "n:s:")) != -1)
+    {
+        if (opt == 'n')
+            mutations = atol(optarg);
+        else if (opt == 's')
+            srand(atoi(optarg));
+        else
+        {
+            fprintf(stderr, "usage: %s [-n mutations] [-s seed] corpusfile...\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    for (int i = optind; i < argc && ninputs < 64; i++)
+    {
+        if ((fp = fopen(argv[i], "rb")) == NULL)
+            unix_error(argv[i]);
+        lens[ninputs] = fread(inputs[ninputs], 1, MAXINPUT, fp);
+        fclose(fp);
+        checkInput(inputs[ninputs], lens[ninputs]);
+        ninputs++;
+    }
+    printf("corpus: %d inputs agree\n", ninputs);
+
+    for (long i = 0; i < mutations && ninputs > 0; i++)
+    {
+        int k = rand() % ninputs;
+        size_t len = lens[k];
+        HttpRequest req;
+        int rc;
+
+        memcpy(buf, inputs[k], len);
+        len = mutate(buf, len);
+        checkInput(buf, len);
+        http_init(&req);
+        rc = http_parse_request(&req, buf, len, RIO_BUFSIZE);
+        results[rc > 0 ? 3 : -rc]++;
+    }
+    printf("mutations: %ld  complete: %d  incomplete: %d  bad: %d  too large: %d\n",
+           mutations, results[3], results[0], results[1], results[2]);
+    return 0;
+}
+#endif
@@ -0,0 +1,125 @@
+/*
+ * loadbench.c - closed-loop HTTP load generator for comparing front ends
+ *
+ * Each of nconns threads connects, sends one HTTP/1.0 GET for uri, reads
+ * the response until the server closes and starts over, for secs seconds.
+ * Point it at tiny with an origin-form uri for the baseline, and at the
+ * proxy, started with or without -u, with an absolute one.
+ *
+ * usage: ./loadbench [-c nconns] [-t secs] <host> <port> <uri>
+ */
+#include "csapp.h"
+
+#define MAX_SAMPLES (1 << 20)
+
+typedef struct {
+    long requests;
+    long errors;
+    long bytes;
+    long *latency;             /* Microseconds of each request */
+    long nsamples;
+} Worker;
+
+static char *host, *port, *uri;
+static double deadline;
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void* worker(void *vargp)
+{
+    Worker *w = vargp;
+    char req[MAXLINE], buf[MAXBUF];
+    size_t len = snprintf(req, sizeof(req), "GET %s HTTP/1.0\r\n\r\n", uri);
+    ssize_t n;
+    long got;
+    double start;
+    int fd;
+
+    while ((start = now()) < deadline) {
+        if ((fd = open_clientfd(host, port)) < 0) {
+            w->errors++;
+            continue;
+        }
+        got = 0;
+        if (rio_writen(fd, req, len) == len)
+            while ((n = read(fd, buf, sizeof(buf))) > 0)
+                got += n;
+        close(fd);
+        if (got == 0) {
+            w->errors++;
+            continue;
+        }
+        w->requests++;
+        w->bytes += got;
+        if (w->nsamples < MAX_SAMPLES)
+            w->latency[w->nsamples++] = (now() - start) * 1e6;
+    }
+    return NULL;
+}
+
+static int cmplong(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv)
+{
+    int nconns = 8, secs = 5, opt;
+    long requests = 0, errors = 0, bytes = 0, n = 0, *all;
+    pthread_t *tids;
+    Worker *workers;
+    double start;
+
+    while ((opt = getopt(argc, argv, "c:t:")) != -1) {
+        if (opt == 'c')
+            nconns = atoi(optarg);
+        else if (opt == 't')
+            secs = atoi(optarg);
+        else
+            break;
+    }
+    if (opt != -1 || optind != argc - 3 || nconns < 1 || secs < 1) {
+        fprintf(stderr, "usage: %s [-c nconns] [-t secs] <host> <port> <uri>\n", argv[0]);
+        exit(1);
+    }
+    host = argv[optind];
+    port = argv[optind + 1];
+    uri = argv[optind + 2];
+
+    tids = Calloc(nconns, sizeof(pthread_t));
+    workers = Calloc(nconns, sizeof(Worker));
+    start = now();
+    deadline = start + secs;
+    for (int i = 0; i < nconns; i++) {
+        workers[i].latency = Malloc(MAX_SAMPLES * sizeof(long));
+        Pthread_create(&tids[i], NULL, worker, &workers[i]);
+    }
+    for (int i = 0; i < nconns; i++)
+        Pthread_join(tids[i], NULL);
+    double elapsed = now() - start;
+
+    for (int i = 0; i < nconns; i++)
+        n += workers[i].nsamples;
+    if (n == 0)
+        app_error("no request succeeded");
+    all = Malloc(n * sizeof(long));
+    n = 0;
+    for (int i = 0; i < nconns; i++) {
+        requests += workers[i].requests;
+        errors += workers[i].errors;
+        bytes += workers[i].bytes;
+        memcpy(all + n, workers[i].latency, workers[i].nsamples * sizeof(long));
+        n += workers[i].nsamples;
+    }
+    qsort(all, n, sizeof(long), cmplong);
+    printf("conns: %3d  requests/s: %8.0f  MB/s: %8.1f  p50: %6ldus  "
+           "p99: %6ldus  errors: %ld\n", nconns, requests / elapsed,
+           bytes / elapsed / 1e6, all[n / 2], all[n * 99 / 100], errors);
+    return 0;
+}
@@ -1,45 +1,41 @@
 #include "lock.h"
 
-sem_t mutex, w;
-sem_t rw;  // 实现公平读写，FIFO
-int readcnt;
-
-void initRWLock()
+void initRWLock(RWLock *lock)
 {
-    Sem_init(&mutex, 0, 1);
-    Sem_init(&w, 0, 1);
-    Sem_init(&rw, 0, 1);
-    readcnt = 0;
+    Sem_init(&lock->mutex, 0, 1);
+    Sem_init(&lock->w, 0, 1);
+    Sem_init(&lock->rw, 0, 1);  // 实现公平读写，FIFO
+    lock->readcnt = 0;
 }
 
-void lock_reader()
+void lock_reader(RWLock *lock)
 {
-    P(&rw);
-    P(&mutex);
-    readcnt++;
-    if (readcnt == 1)  // 第一个读开始，锁住写
-        P(&w);
-    V(&mutex);
-    V(&rw);
+    P(&lock->rw);
+    P(&lock->mutex);
+    lock->readcnt++;
+    if (lock->readcnt == 1)  // 第一个读开始，锁住写
+        P(&lock->w);
+    V(&lock->mutex);
+    V(&lock->rw);
 }
 
-void unlock_reader()
+void unlock_reader(RWLock *lock)
 {
-    P(&mutex);
-    readcnt--;
-    if (readcnt == 0)  // 读结束，可以写
-        V(&w);
-    V(&mutex);
+    P(&lock->mutex);
+    lock->readcnt--;
+    if (lock->readcnt == 0)  // 读结束，可以写
+        V(&lock->w);
+    V(&lock->mutex);
 }
 
-void lock_writer()
+void lock_writer(RWLock *lock)
 {
-    P(&rw);
-    P(&w);
-    V(&rw);
+    P(&lock->rw);
+    P(&lock->w);
+    V(&lock->rw);
 }
 
-void unlock_writer()
+void unlock_writer(RWLock *lock)
 {
-    V(&w);
+    V(&lock->w);
 }
\ No newline at end of file
@@ -1,11 +1,19 @@
+#ifndef __LOCK_H__
+#define __LOCK_H__
+
 #include "csapp.h"
 
-extern sem_t mutex, w;
-extern sem_t rw;
-extern int readcnt;
+/* Fair reader/writer lock built on semaphores */
+typedef struct {
+    sem_t mutex, w;
+    sem_t rw;
+    int readcnt;
+} RWLock;
+
+void initRWLock(RWLock *lock);
+void lock_reader(RWLock *lock);
+void unlock_reader(RWLock *lock);
+void lock_writer(RWLock *lock);
+void unlock_writer(RWLock *lock);
 
-void initRWLock();
-void lock_reader();
-void unlock_reader();
-void lock_writer();
-void unlock_writer();
\ No newline at end of file
+#endif
\ No newline at end of file
@@ -0,0 +1,316 @@
+/*
+ * policy.c - eviction policies for the proxy cache
+ *
+ * LRU      one queue, a hit moves the node to the head.
+ * CLOCK    one queue, a hit only sets the reference bit. The victim scan
+ *          gives referenced nodes at the tail a second chance.
+ * S3-FIFO  a small FIFO for new nodes and a main FIFO. Nodes hit while in
+ *          the small queue move to main, others are evicted and remembered
+ *          in a ghost list so that they go straight to main next time.
+ *          A hit only bumps a 2-bit counter.
+ * TinyLFU  W-TinyLFU: a small LRU window in front of a segmented LRU. The
+ *          window's victim replaces the main victim only if a count-min
+ *          sketch says it is used more often.
+ */
+#include "policy.h"
+
+#define Q_FIRST 0      /* LRU/CLOCK queue, S3-FIFO small, TinyLFU window */
+#define Q_SECOND 1     /* S3-FIFO main, TinyLFU probation */
+#define Q_THIRD 2      /* TinyLFU protected */
+
+#define S3_SMALL_PERCENT 10
+#define TINYLFU_WINDOW_PERCENT 1
+#define TINYLFU_PROTECTED_PERCENT 80
+
+/*************************
+ * Queues shared by all policies
+ *************************/
+
+void initQueues(Shard *shard)
+{
+    for (int i = 0; i < CACHE_NQUEUES; i++)
+    {
+        Queue *q = &shard->queues[i];
+        memset(q, 0, sizeof(Queue));
+        q->head.next = &q->tail;
+        q->tail.pre = &q->head;
+    }
+}
+
+static void pushHead(Shard *shard, int queue, Node *node)
+{
+    Queue *q = &shard->queues[queue];
+
+    node->queue = queue;
+    node->next = q->head.next;
+    node->pre = &q->head;
+    q->head.next->pre = node;
+    q->head.next = node;
+    q->size += node->size;
+}
+
+/* Put a node back behind the least recent one, as victims were */
+void pushTail(Shard *shard, int queue, Node *node)
+{
+    Queue *q = &shard->queues[queue];
+
+    node->queue = queue;
+    node->pre = q->tail.pre;
+    node->next = &q->tail;
+    q->tail.pre->next = node;
+    q->tail.pre = node;
+    q->size += node->size;
+}
+
+void unlinkNode(Shard *shard, Node *node)
+{
+    node->pre->next = node->next;
+    node->next->pre = node->pre;
+    shard->queues[node->queue].size -= node->size;
+}
+
+static void moveHead(Shard *shard, int queue, Node *node)
+{
+    unlinkNode(shard, node);
+    pushHead(shard, queue, node);
+}
+
+/* Least recent node of a queue, NULL if it is empty */
+static Node* queueTail(Shard *shard, int queue)
+{
+    Queue *q = &shard->queues[queue];
+    return q->tail.pre != &q->head ? q->tail.pre : NULL;
+}
+
+/*************************
+ * Frequency sketch shared by admission and TinyLFU
+ *************************/
+
+static unsigned int sketchIndex(unsigned int hash, int row)
+{
+    hash ^= hash >> 15;
+    hash *= 0x2c1b3c6du + 2 * row;
+    hash ^= hash >> 12;
+    return hash % SKETCH_WIDTH;
+}
+
+/*
+ * Count a lookup, halving all counters now and then so counts age.
+ * Called under the reader lock, losing a racing increment is harmless.
+ */
+void sketchAdd(Shard *shard, unsigned int hash)
+{
+    int added = 0;
+
+    for (int i = 0; i < SKETCH_DEPTH; i++)
+    {
+        unsigned char *c = &shard->sketch[i][sketchIndex(hash, i)];
+        unsigned char n = __atomic_load_n(c, __ATOMIC_RELAXED);
+        if (n < 15)
+        {
+            __atomic_store_n(c, n + 1, __ATOMIC_RELAXED);
+            added = 1;
+        }
+    }
+
+    /* Saturated keys stop writing, so hot hits do not bounce the line */
+    if (added && __sync_add_and_fetch(&shard->sketchAdds, 1) ==
+                 10 * SKETCH_WIDTH)
+    {
+        for (int i = 0; i < SKETCH_DEPTH; i++)
+            for (int j = 0; j < SKETCH_WIDTH; j++)
+                __atomic_store_n(&shard->sketch[i][j],
+                                 shard->sketch[i][j] >> 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&shard->sketchAdds, 0, __ATOMIC_RELAXED);
+    }
+}
+
+/* Estimated lookups of a key since counts last aged, at most 15 */
+int sketchCount(Shard *shard, unsigned int hash)
+{
+    int min = 15;
+    for (int i = 0; i < SKETCH_DEPTH; i++)
+    {
+        int c = __atomic_load_n(&shard->sketch[i][sketchIndex(hash, i)],
+                                __ATOMIC_RELAXED);
+        if (c < min)
+            min = c;
+    }
+    return min;
+}
+
+/*************************
+ * LRU
+ *************************/
+
+static void lruInsert(Shard *shard, Node *node)
+{
+    pushHead(shard, Q_FIRST, node);
+}
+
+static void lruHit(Shard *shard, Node *node)
+{
+    moveHead(shard, Q_FIRST, node);
+}
+
+static Node* lruVictim(Shard *shard)
+{
+    return queueTail(shard, Q_FIRST);
+}
+
+const Policy lruPolicy = { "lru", 1, lruInsert, lruHit, lruVictim };
+
+/*************************
+ * CLOCK
+ *************************/
+
+static void clockHit(Shard *shard, Node *node)
+{
+    if (!node->freq)
+        __atomic_store_n(&node->freq, 1, __ATOMIC_RELAXED);
+}
+
+static Node* clockVictim(Shard *shard)
+{
+    Node *node;
+
+    /* The hand sweeps from the tail, referenced nodes go around again */
+    while ((node = queueTail(shard, Q_FIRST)) != NULL && node->freq)
+    {
+        node->freq = 0;
+        moveHead(shard, Q_FIRST, node);
+    }
+    return node;
+}
+
+const Policy clockPolicy = { "clock", 0, lruInsert, clockHit, clockVictim };
+
+/*************************
+ * S3-FIFO
+ *************************/
+
+static int inGhost(Shard *shard, unsigned int hash)
+{
+    for (int i = 0; i < GHOST_SIZE; i++)
+        if (shard->ghost[i] == hash)
+            return 1;
+    return 0;
+}
+
+static void s3Insert(Shard *shard, Node *node)
+{
+    pushHead(shard, inGhost(shard, node->hash) ? Q_SECOND : Q_FIRST, node);
+}
+
+static void s3Hit(Shard *shard, Node *node)
+{
+    int freq = node->freq;
+
+    /* Losing a racing increment is harmless */
+    if (freq < 3)
+        __atomic_store_n(&node->freq, freq + 1, __ATOMIC_RELAXED);
+}
+
+static Node* s3Victim(Shard *shard)
+{
+    Node *node;
+
+    while (1)
+    {
+        int fromSmall = queueTail(shard, Q_SECOND) == NULL ||
+            shard->queues[Q_FIRST].size * 100 >
+                shard->arena.size * S3_SMALL_PERCENT;
+
+        if (fromSmall && (node = queueTail(shard, Q_FIRST)) != NULL)
+        {
+            if (node->freq == 0)
+            {
+                shard->ghost[shard->ghostNext] = node->hash;
+                shard->ghostNext = (shard->ghostNext + 1) % GHOST_SIZE;
+                return node;
+            }
+            node->freq = 0;
+            moveHead(shard, Q_SECOND, node);
+        }
+        else if ((node = queueTail(shard, Q_SECOND)) != NULL)
+        {
+            if (node->freq == 0)
+                return node;
+            node->freq--;
+            moveHead(shard, Q_SECOND, node);
+        }
+        else
+            return NULL;
+    }
+}
+
+const Policy s3fifoPolicy = { "s3fifo", 0, s3Insert, s3Hit, s3Victim };
+
+/*************************
+ * W-TinyLFU
+ *************************/
+
+static void tinylfuHit(Shard *shard, Node *node)
+{
+    Node *demoted;
+
+    if (node->queue == Q_FIRST)
+    {
+        moveHead(shard, Q_FIRST, node);
+        return;
+    }
+
+    /* Probation and protected hits go to protected, overflow is demoted */
+    moveHead(shard, Q_THIRD, node);
+    while (shard->queues[Q_THIRD].size * 100 >
+               shard->arena.size * TINYLFU_PROTECTED_PERCENT &&
+           (demoted = queueTail(shard, Q_THIRD)) != node)
+        moveHead(shard, Q_SECOND, demoted);
+}
+
+static Node* tinylfuVictim(Shard *shard)
+{
+    Node *candidate, *victim;
+
+    while (1)
+    {
+        if ((victim = queueTail(shard, Q_SECOND)) == NULL)
+            victim = queueTail(shard, Q_THIRD);
+        candidate = queueTail(shard, Q_FIRST);
+
+        /* Window within its share, evict from main */
+        if (candidate == NULL ||
+            (victim != NULL && shard->queues[Q_FIRST].size * 100 <=
+                 shard->arena.size * TINYLFU_WINDOW_PERCENT))
+            return victim;
+
+        /* Window's victim competes for a place in main */
+        if (victim == NULL)
+        {
+            moveHead(shard, Q_SECOND, candidate);
+            continue;
+        }
+        if (sketchCount(shard, candidate->hash) >
+            sketchCount(shard, victim->hash))
+        {
+            moveHead(shard, Q_SECOND, candidate);
+            return victim;
+        }
+        return candidate;
+    }
+}
+
+const Policy tinylfuPolicy = { "tinylfu", 1, lruInsert, tinylfuHit, tinylfuVictim };
+
+/* Look a policy up by name, NULL if unknown */
+const Policy* findPolicy(const char *name)
+{
+    static const Policy *policies[] = {
+        &lruPolicy, &clockPolicy, &s3fifoPolicy, &tinylfuPolicy
+    };
+
+    for (int i = 0; i < sizeof(policies) / sizeof(policies[0]); i++)
+        if (!strcasecmp(policies[i]->name, name))
+            return policies[i];
+    return NULL;
+}
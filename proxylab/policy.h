@@ -0,0 +1,32 @@
+#ifndef __POLICY_H__
+#define __POLICY_H__
+
+#include "cache.h"
+
+/*
+ * An eviction policy orders the nodes of a shard in its queues.
+ * hit is called under the reader lock unless hitNeedsWriter is set, so
+ * policies that only mark the node must update it atomically. insert and
+ * victim are called under the writer lock. victim picks a node to evict,
+ * it may move other nodes on the way but must return one if any exists.
+ * The victim is at the tail of its queue, so the cache can take victims
+ * out to ask for the next one, and put them back with pushTail.
+ */
+typedef struct Policy {
+    const char *name;
+    int hitNeedsWriter;
+    void (*insert)(Shard *shard, Node *node);
+    void (*hit)(Shard *shard, Node *node);
+    Node* (*victim)(Shard *shard);
+} Policy;
+
+extern const Policy lruPolicy, clockPolicy, s3fifoPolicy, tinylfuPolicy;
+const Policy* findPolicy(const char *name);
+
+void initQueues(Shard *shard);
+void unlinkNode(Shard *shard, Node *node);
+void pushTail(Shard *shard, int queue, Node *node);
+void sketchAdd(Shard *shard, unsigned int hash);
+int sketchCount(Shard *shard, unsigned int hash);
+
+#endif
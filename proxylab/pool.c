@@ -0,0 +1,85 @@
+#include "pool.h"
+#include "cache.h"
+
+static unsigned int hashOrigin(const char *origin)
+{
+    return hashKey(origin) % POOL_NBUCKETS;
+}
+
+/* An idle connection is dead if the server closed it or sent anything */
+static int isAlive(int fd)
+{
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+void pool_init(ConnPool *pool)
+{
+    memset(pool->buckets, 0, sizeof(pool->buckets));
+    Sem_init(&pool->mutex, 0, 1);
+}
+
+/*
+ * pool_get - take an idle connection to hostname:port out of the pool,
+ *            return -1 if there is none
+ */
+int pool_get(ConnPool *pool, const char *hostname, const char *port)
+{
+    char origin[MAXLINE];
+    PoolConn **pp, *p;
+    time_t now = time(NULL);
+    int fd = -1;
+
+    snprintf(origin, MAXLINE, "%s:%s", hostname, port);
+    P(&pool->mutex);
+    pp = &pool->buckets[hashOrigin(origin)];
+    while ((p = *pp) != NULL)
+    {
+        if (strcmp(p->origin, origin) != 0)
+        {
+            pp = &p->next;
+            continue;
+        }
+        *pp = p->next;
+        if (fd < 0 && now - p->since < POOL_IDLE_SECS && isAlive(p->fd))
+            fd = p->fd;
+        else
+            close(p->fd);
+        free(p->origin);
+        free(p);
+        if (fd >= 0)
+            break;
+    }
+    V(&pool->mutex);
+    return fd;
+}
+
+/* Return a connection whose last response was fully read */
+void pool_put(ConnPool *pool, const char *hostname, const char *port, int fd)
+{
+    char origin[MAXLINE];
+    PoolConn *p, **bucket;
+    int idle = 0;
+
+    snprintf(origin, MAXLINE, "%s:%s", hostname, port);
+    P(&pool->mutex);
+    bucket = &pool->buckets[hashOrigin(origin)];
+    for (p = *bucket; p != NULL; p = p->next)
+        if (strcmp(p->origin, origin) == 0)
+            idle++;
+    if (idle >= POOL_MAX_IDLE)
+    {
+        V(&pool->mutex);
+        close(fd);
+        return;
+    }
+
+    p = Malloc(sizeof(PoolConn));
+    p->fd = fd;
+    p->origin = strdup(origin);
+    p->since = time(NULL);
+    p->next = *bucket;
+    *bucket = p;
+    V(&pool->mutex);
+}
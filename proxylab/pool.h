@@ -0,0 +1,28 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include "csapp.h"
+
+/* Idle persistent connections kept per origin and how long they live */
+#define POOL_MAX_IDLE 8
+#define POOL_IDLE_SECS 30
+#define POOL_NBUCKETS 64
+
+typedef struct PoolConn {
+    int fd;
+    char *origin;              /* "host:port" */
+    time_t since;              /* When it became idle */
+    struct PoolConn *next;
+} PoolConn;
+
+/* Idle upstream connections hashed by origin */
+typedef struct {
+    PoolConn *buckets[POOL_NBUCKETS];
+    sem_t mutex;               /* Protects buckets */
+} ConnPool;
+
+void pool_init(ConnPool *pool);
+int pool_get(ConnPool *pool, const char *hostname, const char *port);
+void pool_put(ConnPool *pool, const char *hostname, const char *port, int fd);
+
+#endif
@@ -1,53 +1,138 @@
 #include <stdio.h>
+#include <netinet/tcp.h>
 #include "csapp.h"
 #include "cache.h"
-#include "sbuf.h"
+#include "policy.h"
+#include "workers.h"
+#include "event.h"
+#include "uring.h"
+#include "pool.h"
+#include "flight.h"
+#include "disk.h"
+#include "dns.h"
+#include "alog.h"
+#include "stats.h"
+#include "http.h"
+#include "splice.h"
+#include "proxy.h"
 
-#define NTHREADS 4
-#define SBUFSIZE 16
+#define NTHREADS 4     /* Default least number of workers */
+#define MAXTHREADS 64  /* Default most number of workers */
+#define KEEPALIVE_MS 5000  /* How long an idle client connection is kept */
 #define PRETHREAD
+// #define REUSEPORT  /* One acceptor per core, each on its own listening socket */
+// #define EPOLL  /* Event-driven front end, one loop per core */
 
 /* You won't lose style points for including this long line in your code */
-static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
+const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 
 void* thread(void *vargp);
-void doit(int fd);
-int parse_uri(char *uri, char *hostname, char *port, char *path);
-void forward_requesthdrs(rio_t *rp, int fd, char *hostname);
-size_t forward_response(rio_t *rp, int fd, char *cbuf);
+void* acceptor(void *vargp);
+void accepted(int fd);
+void serve(int fd);
+int doit(int fd, rio_t *rp, AccessRecord *rec);
+int queue_request(rio_writer_t *out, char *method, HttpRequest *req,
+                  char *hostname, Node *stale);
+int send_request(rio_writer_t *out, char *hostname, char *port, int pooled,
+                 int *reused, Deadline *dl);
+int send_cached(int fd, Node *node, int keepalive, AccessRecord *rec);
+int send_disk(int fd, DiskHit *hit, int keepalive, AccessRecord *rec);
+int send_stats(int fd, int keepalive);
+void spill(Node *node);
+int forward_requesthdrs(HttpRequest *req, rio_writer_t *out, char *hostname,
+                        Node *stale);
+int forward_response(rio_t *rp, int fd, Fill *fill, int *keepalive, int *framed,
+                     int *complete, int revalidate, int dechunk, long *firstByte,
+                     Deadline *dl);
 void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg);
 
 /* global variables*/
 Cache proxyCache;
-sbuf_t sbuf;  /* Shared buffer of connected descriptors */
+ConnPool connPool;  /* Idle keep-alive connections to servers */
+FlightTable flights;  /* Misses being fetched from servers */
+DiskCache diskCache;  /* Second tier for evicted objects, if -d is given */
+WorkerPool workers;  /* Prethreaded workers and their connected descriptors */
+DnsCache dnsCache;  /* Resolved server names */
+TimerWheel timers;  /* Deadlines of blocking reads and connects */
+long *acceptedAt;  /* When each descriptor was accepted, for the access log */
 
 int main(int argc, char **argv)
 {
     int listenfd;
-    char hostname[MAXLINE], port[MAXLINE];
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
-    pthread_t tid;
 
-    /* Check command line args */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    /* Check command line args, -A turns the admission filter off,
+       -n and -N bound the number of workers, -u serves with io_uring
+       loops instead */
+    const Policy *policy = &lruPolicy;
+    char *diskfile = NULL, *logfile = NULL;
+    int admit = 1, minWorkers = NTHREADS, maxWorkers = MAXTHREADS, uring = 0, opt;
+    while ((opt = getopt(argc, argv, "p:Ad:l:n:N:u")) != -1) {
+        if (opt == 'A')
+            admit = 0;
+        else if (opt == 'u')
+            uring = 1;
+        else if (opt == 'd')
+            diskfile = optarg;
+        else if (opt == 'l')
+            logfile = optarg;
+        else if (opt == 'n')
+            minWorkers = atoi(optarg);
+        else if (opt == 'N')
+            maxWorkers = atoi(optarg);
+        else if (opt != 'p' || (policy = findPolicy(optarg)) == NULL)
+            break;
+    }
+    if (opt != -1 || optind != argc - 1 || minWorkers < 1 || maxWorkers < minWorkers) {
+        fprintf(stderr, "usage: %s [-p lru|clock|s3fifo|tinylfu] [-A] [-d diskfile] "
+                "[-l logfile] [-n minworkers] [-N maxworkers] [-u] <port>\n", argv[0]);
         exit(1);
     }
+    char *listenport = argv[optind];
 
-    /* Initialize cache */
-    initCache(&proxyCache);
+    /* A server closing a pooled connection must not kill the proxy */
+    Signal(SIGPIPE, SIG_IGN);
 
-    #ifdef PRETHREAD
-    /* Create worker threads */
-    sbuf_init(&sbuf, SBUFSIZE);
-    for (int i = 0; i < NTHREADS; i++)
-    {
-        Pthread_create(&tid, NULL, thread, NULL);
+    /* Initialize cache and connection pool */
+    initCache(&proxyCache, policy, admit);
+    if (diskfile != NULL) {
+        disk_open(&diskCache, diskfile);
+        spillCache(&proxyCache, spill);
+    }
+    pool_init(&connPool);
+    initFlights(&flights);
+    dns_init(&dnsCache);
+    timer_init(&timers);
+    acceptedAt = Calloc(sysconf(_SC_OPEN_MAX), sizeof(long));
+    stats_init();
+    if (logfile != NULL)
+        alog_open(logfile);
+
+    if (uring) {
+        listenfd = Open_listenfd(listenport);
+        start_uring_loops(listenfd, sysconf(_SC_NPROCESSORS_ONLN));
     }
+
+    #ifdef EPOLL
+    listenfd = Open_listenfd(listenport);
+    start_event_loops(listenfd, sysconf(_SC_NPROCESSORS_ONLN));
+    #endif
+
+    #ifdef PRETHREAD
+    /* Create worker threads, more are added under load */
+    workers_init(&workers, minWorkers, maxWorkers, serve);
     #endif
 
-    listenfd = Open_listenfd(argv[1]);
+    #ifdef REUSEPORT
+    /* The kernel spreads connections over the acceptors' sockets */
+    pthread_t atid;
+    for (int i = 1; i < sysconf(_SC_NPROCESSORS_ONLN); i++)
+        Pthread_create(&atid, NULL, acceptor, listenport);
+    acceptor(listenport);
+    #endif
+
+    listenfd = Open_listenfd(listenport);
 
     #ifdef PRETHREAD
     int connfd;
@@ -55,21 +140,18 @@ int main(int argc, char **argv)
     {
         clientlen = sizeof(clientaddr);
         connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-        Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE, 
-                    port, MAXLINE, 0);
-        printf("Accepted connection from (%s, %s)\n", hostname, port);
-        sbuf_insert(&sbuf, connfd);  /* Insert connfd in buffer */
+        accepted(connfd);
+        workers_submit(&workers, connfd);  /* Insert connfd in buffer */
     }
     
     #else
     int *connfdp;
+    pthread_t tid;
     while (1) {
         clientlen = sizeof(clientaddr);
         connfdp = Malloc(sizeof(int));
         *connfdp = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-        Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE, 
-                    port, MAXLINE, 0);
-        printf("Accepted connection from (%s, %s)\n", hostname, port);
+        accepted(*connfdp);
         Pthread_create(&tid, NULL, thread, connfdp);
     }
     #endif
@@ -77,180 +159,682 @@ int main(int argc, char **argv)
     return 0;
 }
 
-/* Thread routine */
-#ifdef PRETHREAD
-void* thread(void *vargp)
+/*
+ * accepted - note when a client connection was accepted, the first request
+ *            on it is timed from then. Nothing is printed here, printing
+ *            would serialize the acceptors on the stdio lock.
+ */
+void accepted(int fd)
 {
-    Pthread_detach(pthread_self());
+    acceptedAt[fd] = alog_now();
+}
+
+/* Acceptor routine, accepts on its own SO_REUSEPORT socket for the workers */
+#ifdef REUSEPORT
+void* acceptor(void *vargp)
+{
+    int listenfd = Open_listenfd_reuseport((char *)vargp);
+    struct sockaddr_storage clientaddr;
+    socklen_t clientlen;
+    int connfd;
+
     while (1)
     {
-        int connfd = sbuf_remove(&sbuf);  /* Remove connfd from buffer */
-        doit(connfd);
-        Close(connfd);
+        clientlen = sizeof(clientaddr);
+        connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
+        accepted(connfd);
+        workers_submit(&workers, connfd);
     }
     return NULL;
 }
-#else
+#endif
+
+/* Thread routine */
+#ifndef PRETHREAD
 void* thread(void *vargp)
 {
     int fd = *((int *)vargp);
     Pthread_detach(pthread_self());
     Free(vargp);
-    doit(fd);
-    Close(fd);
+    serve(fd);
     return NULL;
 }
 #endif
 
 /*
- * doit - handle one HTTP request/response transaction
+ * wait_request - wait at most ms for the client to start another request,
+ *                return 1 if it did
+ */
+static int wait_request(int fd, rio_t *rp, int ms)
+{
+    Deadline idle;
+    ssize_t n;
+
+    deadline_start(&idle, &timers, fd, SHUT_RD, ms);
+    n = rio_fill(rp);
+    return !deadline_stop(&idle) && n > 0;
+}
+
+/*
+ * serve - handle requests on a client connection in order until the client
+ *         closes, asks to close, or stays idle for KEEPALIVE_MS
+ */
+void serve(int fd)
+{
+    rio_t rio;
+    AccessRecord rec;
+    int one = 1, keepalive;
+    struct timeval tv = { CLIENT_TIMEOUT_MS / 1000, CLIENT_TIMEOUT_MS % 1000 * 1000 };
+
+    /* Responses go out line by line, don't let Nagle hold back the last one */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    /* A client that stops reading fails each write after CLIENT_TIMEOUT_MS */
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    Rio_readinitb(&rio, fd);
+    alog_client(&rec, fd);
+    alog_start(&rec, acceptedAt[fd]);
+    while (1) {
+        keepalive = doit(fd, &rio, &rec);
+        alog_write(&rec);
+        stats_record(&rec);
+        /* Pipelined requests are already buffered */
+        if (!keepalive || (rio.rio_cnt == 0 && !wait_request(fd, &rio, KEEPALIVE_MS)))
+            break;
+        alog_start(&rec, 0);
+    }
+    Close(fd);
+}
+
+/*
+ * doit - handle one HTTP request/response transaction on rio_server,
+ *        return 1 if the client connection can carry another request
  */
 /* $begin doit */
-void doit(int fd) 
+int doit(int fd, rio_t *rio_server, AccessRecord *rec) 
 {
-    char sbuf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    rio_t rio_server;
-    char cacheBuf[MAX_OBJECT_SIZE];
-
-    /* Read request line */
-    Rio_readinitb(&rio_server, fd);
-    if (!Rio_readlineb(&rio_server, sbuf, MAXLINE)) {  //line:netp:doit:readrequest
-        return;
+    char sbuf[MAXLINE], method[HTTP_MAX_METHOD + 1], cause[MAXBUF];
+    HttpRequest req;
+    Fill fill;
+    Node *node;
+    Flight *flight;
+    Deadline dl;
+    int clientKeepalive, framed, complete, leader, status, n, late, pooled;
+
+    /* Read the request head into the rio buffer and parse it there, a
+       client that takes too long gets a 408 if it sent anything */
+    http_init(&req);
+    deadline_start(&dl, &timers, fd, SHUT_RD, CLIENT_TIMEOUT_MS);
+    while ((n = http_parse_request(&req, rio_server->rio_bufptr, rio_server->rio_cnt,
+                                   RIO_BUFSIZE)) == HTTP_INCOMPLETE)
+        if (rio_fill(rio_server) <= 0)
+            break;
+    if (deadline_stop(&dl) && n == HTTP_INCOMPLETE && rio_server->rio_cnt > 0) {
+        rec->status = 408;
+        alog_request(rec, "-");
+        clienterror(fd, "request", "408", "Request Timeout",
+                    "Proxy timed out waiting for the request");
+        return 0;
     }
-    printf("%s", sbuf);
+    if (n == HTTP_INCOMPLETE)
+        return 0;
+    if (n < 0) {
+        rec->status = n == HTTP_TOO_LARGE ? 431 : 400;
+        alog_request(rec, "-");
+        clienterror(fd, "request", n == HTTP_TOO_LARGE ? "431" : "400",
+                    n == HTTP_TOO_LARGE ? "Request Header Fields Too Large" : "Bad Request",
+                    "Proxy could not parse the request");
+        return 0;
+    }
+    /* Consumed, the views stay valid until the buffer is filled again */
+    rio_server->rio_bufptr += n;
+    rio_server->rio_cnt -= n;
 
-    /* Check whether the request is cached and read if cached */
-    if (readCache(&proxyCache, sbuf, cacheBuf) >= 0)
-    {
-        printf("Cache hit. Read from cache.\n");
-        Rio_writen(fd, cacheBuf, strlen(cacheBuf));
-        return;
+    /* The request line is the cache key */
+    http_copy(sbuf, sizeof(sbuf), req.line);
+    http_copy(method, sizeof(method), req.method);
+    alog_request(rec, sbuf);
+    clientKeepalive = http_keepalive(&req);
+
+    /* Asked of the proxy itself */
+    if (http_eq(req.uri, STATS_URI)) {
+        rec->status = 200;
+        return send_stats(fd, clientKeepalive);
     }
 
-    sscanf(sbuf, "%s %s %s", method, uri, version);      //line:netp:doit:parserequest
-    if (strcasecmp(method, "GET")) {                     //line:netp:doit:beginrequesterr
+    /* Send a fresh cached copy straight from the cache, keep a stale one
+       to revalidate */
+    if ((node = readCache(&proxyCache, sbuf)) != NULL && isFresh(node))
+        return send_cached(fd, node, clientKeepalive, rec);
+
+    /* Evicted from memory but kept on disk */
+    DiskHit hit;
+    if (node == NULL && disk_get(&diskCache, sbuf, &hit))
+        return send_disk(fd, &hit, clientKeepalive, rec);
+
+    if (!http_caseeq(req.method, "GET")) {               //line:netp:doit:beginrequesterr
+        rec->status = 501;
         clienterror(fd, method, "501", "Not Implemented",
                     "Proxy does not implement this method");
-        return;
+        if (node != NULL)
+            releaseNode(node);
+        return 0;
     }                                                    //line:netp:doit:endrequesterr
 
-    /* Parse uri and get hostname */
-    char hostname[MAXLINE], port[MAXLINE], path[MAXLINE];
-    if (parse_uri(uri, hostname, port, path) < 0) {
-        clienterror(fd, uri, "501", "Not Implemented",
+    /* Only http:// URIs name a server */
+    char hostname[MAXLINE], port[NI_MAXSERV];
+    if (req.host.len == 0) {
+        rec->status = 501;
+        http_copy(cause, sizeof(cause), req.uri);
+        clienterror(fd, cause, "501", "Not Implemented",
                     "Proxy does not implement this uri");
-        return;
+        if (node != NULL)
+            releaseNode(node);
+        return 0;
+    }
+
+    /* Wait for a fetch or revalidation of the same object under way */
+    flight = joinFlight(&flights, sbuf, &leader);
+    if (!leader) {
+        waitFlight(&flights, flight);
+        flight = NULL;
+        if (node != NULL)
+            releaseNode(node);
+        if ((node = readCache(&proxyCache, sbuf)) != NULL && isFresh(node))
+            return send_cached(fd, node, clientKeepalive, rec);
+        /* Not cacheable or still stale, fetch it ourselves */
     }
 
-    /* Forward request line */
-    int clientfd;
-    char cbuf[MAXLINE];
+    http_copy(hostname, sizeof(hostname), req.host);
+    if (req.port.len == 0 || http_copy(port, sizeof(port), req.port) == 0)
+        strcpy(port, "80");
+
+    /* Queue the request line and headers, to be sent in one go. Without
+       a descriptor nothing can be flushed, so a head that doesn't fit is
+       refused. */
+    int clientfd, keepalive, reused;
+    rio_writer_t out;
     rio_t rio_client;
-    clientfd = Open_clientfd(hostname, port);
-    Rio_readinitb(&rio_client, clientfd);
-    sprintf(cbuf, "%s %s %s", method, path, "HTTP/1.0\r\n");
-    Rio_writen(clientfd, cbuf, strlen(cbuf));
+    rio_writeinitb(&out, -1);
+    if (queue_request(&out, method, &req, hostname, node) < 0) {
+        rec->status = 414;
+        clienterror(fd, "request", "414", "URI Too Long",
+                    "Proxy could not forward a request this long");
+        if (node != NULL)
+            releaseNode(node);
+        if (flight != NULL)
+            landFlight(&flights, flight);
+        return 0;
+    }
 
-    /* Read and forward requst headers */
-    forward_requesthdrs(&rio_server, clientfd, hostname);
+    /* The server gets UPSTREAM_TIMEOUT_MS to connect, and as long again
+       each time it goes silent */
+    deadline_start(&dl, &timers, -1, SHUT_RDWR, UPSTREAM_TIMEOUT_MS);
+    for (pooled = 1; ; pooled = 0) {
+        clientfd = send_request(&out, hostname, port, pooled, &reused, &dl);
+        if (clientfd < 0) {
+            late = deadline_stop(&dl);
+            rec->status = late ? 504 : 502;
+            clienterror(fd, hostname, late ? "504" : "502",
+                        late ? "Gateway Timeout" : "Bad Gateway",
+                        late ? "Proxy timed out connecting to the server" :
+                        "Proxy could not connect to the server");
+            if (node != NULL)
+                releaseNode(node);
+            if (flight != NULL)
+                landFlight(&flights, flight);
+            return 0;
+        }
+        Rio_readinitb(&rio_client, clientfd);
+        rec->connect = alog_now();
 
-    /* Read and forward response */
-    if (forward_response(&rio_client, fd, cacheBuf) <= MAX_OBJECT_SIZE - strlen(sbuf))
-        writeCache(&proxyCache, sbuf, cacheBuf);
-    
-    Close(clientfd);
+        /* Read and forward response, de-chunked for a client that only
+           knows HTTP/1.0 */
+        initFill(&fill, sbuf);
+        status = forward_response(&rio_client, fd, &fill, &keepalive, &framed,
+                                  &complete, node != NULL, req.minor == 0,
+                                  &rec->firstByte, &dl);
+
+        /* A server may close an idle connection just as it is reused. If
+           that is why there is no answer, nothing reached the client, and
+           the request is sent once more over a new connection. */
+        if (!reused || status != 0 || rec->firstByte != 0 ||
+            deadline_watch(&dl, -1))
+            break;
+        dropFill(&fill);
+        Close(clientfd);
+        queue_request(&out, method, &req, hostname, node);
+    }
+    if ((late = deadline_stop(&dl)) && rec->firstByte == 0) {
+        /* Nothing was sent to the client yet, tell it why */
+        rec->status = 504;
+        clienterror(fd, hostname, "504", "Gateway Timeout",
+                    "Proxy timed out waiting for the server");
+        dropFill(&fill);
+        keepalive = framed = 0;
+    }
+    else if (node != NULL && status == 304) {
+        /* Not modified, the stored copy is good for a while longer */
+        refreshNode(node, &fill);
+        alog_response(rec, ALOG_REVALIDATED, node->value, node->valuelen);
+        rec->bytes = node->valuelen;
+        framed = node->framed;
+        if (rio_writen(fd, node->value, node->valuelen) < 0)
+            framed = 0;  /* The client is gone, don't read another request */
+    }
+    else {
+        rec->cache = ALOG_MISS;
+        rec->status = status;
+        rec->bytes = fill.len;
+        /* A response cut short, by the server or by the deadline shutting
+           the connection down, must not reach later clients from the cache */
+        if (complete && !late)
+            writeCache(&proxyCache, sbuf, &fill, framed);
+        else
+            dropFill(&fill);
+    }
+    if (node != NULL)
+        releaseNode(node);
+    if (flight != NULL)
+        landFlight(&flights, flight);
+
+    /* Keep the connection only if the response ended exactly at its frame
+       and was not shut down by the deadline */
+    if (keepalive && !late && rio_client.rio_cnt == 0)
+        pool_put(&connPool, hostname, port, clientfd);
+    else
+        Close(clientfd);
+
+    /* The client can only find the end of a framed response, one it did
+       not get all of closes the connection */
+    return clientKeepalive && framed;
 }
 /* $end doit */
 
 /*
- * parse_uri - parse URI into hostname and path
- *             return 0 if success, -1 if fail (not http)
+ * queue_request - queue the request line and headers for the server on out,
+ *                 return -1 if they don't fit
  */
-/* $begin parse_uri */
-int parse_uri(char *uri, char *hostname, char *port, char *path) 
+int queue_request(rio_writer_t *out, char *method, HttpRequest *req,
+                  char *hostname, Node *stale)
 {
-    char* ptr, *q;
-    char buf[MAXLINE];
-    if ((ptr = strstr(uri, "http://")) == NULL)
+    if (rio_printfb(out, "%s %s", method,
+                    req->path.len > 0 && req->path.p[0] == '/' ? "" : "/") < 0 ||
+        rio_writeb(out, (char *)req->path.p, req->path.len) < 0 ||
+        rio_printfb(out, " HTTP/1.1\r\n") < 0 ||
+        forward_requesthdrs(req, out, hostname, stale) < 0)
         return -1;
+    return 0;
+}
 
-    ptr += 7;
-    int i = 0;
-    while (*ptr != '/') {
-        buf[i] = *ptr;
-        i++;
-        ptr++;
-    }
-    buf[i] = '\0';
+/*
+ * send_request - send the request queued on out over an idle connection to
+ *                the server if pooled and one takes it, otherwise over a
+ *                new one. Return the connection, with reused telling which
+ *                it was, or -1 if neither could be had.
+ */
+int send_request(rio_writer_t *out, char *hostname, char *port, int pooled,
+                 int *reused, Deadline *dl)
+{
+    int clientfd, one = 1;
 
-    if (q = strchr(buf, ':')) {
-        // 不能直接使用 %s:%s 格式化，':'会被当作字符串的一部分，需要使用空白字符分隔字符串
-        *q = ' ';
-        sscanf(buf, "%s %s", hostname, port);
+    *reused = 0;
+    if (pooled && (clientfd = pool_get(&connPool, hostname, port)) >= 0) {
+        deadline_watch(dl, clientfd);
+        out->rio_fd = clientfd;
+        if (rio_flushb(out) == 0) {
+            *reused = 1;
+            return clientfd;
+        }
+        deadline_watch(dl, -1);
+        Close(clientfd);
     }
-    else {
-        strcpy(hostname, buf);
-        strcpy(port, "80");
+    if ((clientfd = dns_connect(&dnsCache, hostname, port, dl)) < 0)
+        return -1;
+    /* Small header writes on a reused connection must not wait on Nagle */
+    Setsockopt(clientfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    out->rio_fd = clientfd;
+    if (rio_flushb(out) < 0) {
+        deadline_watch(dl, -1);
+        Close(clientfd);
+        return -1;
     }
-        
-    strcpy(path, ptr);
-	return 0;
+    return clientfd;
 }
-/* $end parse_uri */
 
 /*
- * forward_requesthdrs - read and forward HTTP request headers
+ * send_cached - send a cached response and release it, return 1 if the
+ *               client connection can carry another request, 0 also if
+ *               the client went away
+ */
+int send_cached(int fd, Node *node, int keepalive, AccessRecord *rec)
+{
+    int framed = node->framed;
+
+    alog_response(rec, ALOG_HIT, node->value, node->valuelen);
+    rec->bytes = node->valuelen;
+    if (rio_writen(fd, node->value, node->valuelen) < 0)
+        keepalive = 0;
+    releaseNode(node);
+    return keepalive && framed;
+}
+
+/*
+ * send_disk - send a response from the disk tier and unpin it, return 1
+ *             if the client connection can carry another request
+ */
+int send_disk(int fd, DiskHit *hit, int keepalive, AccessRecord *rec)
+{
+    alog_response(rec, ALOG_DISK, diskCache.base + hit->offset, hit->len);
+    rec->bytes = hit->len;
+    if (disk_send(&diskCache, hit, fd) < 0)
+        keepalive = 0;
+    disk_release(&diskCache, hit);
+    return keepalive && hit->framed;
+}
+
+/*
+ * send_stats - send the counters of all threads, the cache size and the
+ *              occupancy of the worker pool
+ */
+int send_stats(int fd, int keepalive)
+{
+    char page[STATS_PAGE_SIZE + MAXLINE], extra[MAXLINE];
+    int queued = 0, nworkers = 0, nidle = 0, added = 0, retired = 0;
+
+    #ifdef PRETHREAD
+    workers_stats(&workers, &queued, &nworkers, &nidle, &added, &retired);
+    #endif
+    sprintf(extra, "\"cache_size\":%zu,\"queued\":%d,\"workers\":%d,"
+            "\"idle_workers\":%d,\"workers_added\":%d,\"workers_retired\":%d",
+            cacheSize(&proxyCache), queued, nworkers, nidle, added, retired);
+    if (rio_writen(fd, page, stats_page(page, sizeof(page), extra)) < 0)
+        keepalive = 0;
+    return keepalive;
+}
+
+/* Nodes evicted from the memory cache go to the disk tier */
+void spill(Node *node)
+{
+    disk_put(&diskCache, node);
+}
+
+/* Whether a header value contains token, ignoring case */
+static int hasToken(const char *value, const char *token)
+{
+    size_t len = strlen(token);
+    for (; *value; value++)
+        if (!strncasecmp(value, token, len))
+            return 1;
+    return 0;
+}
+
+/*
+ * forward_requesthdrs - queue the parsed request headers on out, each line
+ *                       as it came, without copying it. For a stale cached
+ *                       copy, the client's conditions are replaced by one
+ *                       that revalidates it. RIO_MAXIOV exceeds
+ *                       HTTP_MAX_HEADERS plus the lines added here, but the
+ *                       lines formatted here, such as a long Host, may not
+ *                       fit wbuf. Return -1 if they don't, out has no
+ *                       descriptor to flush them to yet.
  */
 /* $begin forward_requesthdrs */
-void forward_requesthdrs(rio_t *rp, int fd, char *hostname) 
+int forward_requesthdrs(HttpRequest *req, rio_writer_t *out, char *hostname,
+                        Node *stale)
 {
-    char buf[MAXLINE], header[MAXLINE], temp[MAXLINE];
+    char buf[MAXLINE];
     int hasHost = 0;
 
-    Rio_readlineb(rp, buf, MAXLINE);
-    while(strcmp(buf, "\r\n")) {          //line:netp:readhdrs:checkterm
-        sscanf(buf, "%s:%s", header, temp);
-        if (!strcasecmp(header, "Host"))
+    for (int i = 0; i < req->nheaders; i++) {
+        HttpHeader *h = &req->headers[i];
+        if (http_caseeq(h->name, "Host"))
             hasHost = 1;
-        Rio_writen(fd, buf, strlen(buf));
-        Rio_readlineb(rp, buf, MAXLINE);
+        /* Hop-by-hop headers are replaced by our own */
+        if (!http_hop_by_hop(h) &&
+            !(stale != NULL && (http_caseeq(h->name, "If-None-Match") ||
+                                http_caseeq(h->name, "If-Modified-Since"))))
+            if (rio_writeb(out, (char *)h->line.p, h->line.len) < 0)
+                return -1;
     }
-    
+
     /* Add headers */
-    if (!hasHost) {
-        sprintf(buf, "Host: %s\r\n", hostname);
-        Rio_writen(fd, buf, strlen(buf));
-    }
-    sprintf(buf, user_agent_hdr);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Connection: close\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Proxy-Connection: close\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    return;
+    if (!hasHost && rio_printfb(out, "Host: %s\r\n", hostname) < 0)
+        return -1;
+    if (stale != NULL)
+        revalidateHeaders(stale, buf);
+    else
+        buf[0] = '\0';
+    if (rio_printfb(out, "%s", user_agent_hdr) < 0 ||
+        rio_printfb(out, "Connection: keep-alive\r\n") < 0 ||
+        rio_printfb(out, "Proxy-Connection: keep-alive\r\n") < 0 ||
+        rio_printfb(out, "%s\r\n", buf) < 0)
+        return -1;
+    return 0;
 }
 /* $end forward_requesthdrs */
 
 /*
- * forward_response - read and forward HTTP response, write response to cacheBuf
+ * relay - send n bytes of the response to the client unless fd < 0, tee
+ *         them into the cache fill unless it is NULL, while the response
+ *         fits. Return -1 if the client can't take them, it may have reset
+ *         the connection.
  */
-/* $begin forward_response */
-size_t forward_response(rio_t *rp, int fd, char *cbuf) 
+static int relay(int fd, Fill *fill, char *buf, size_t n)
+{
+    if (fill != NULL)
+        appendFill(fill, buf, n);
+    if (fd >= 0 && rio_writen(fd, buf, n) < 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * forward_body - relay length bytes of body, or up to EOF if length < 0,
+ *                return the number of bytes relayed, -1 if a read or a
+ *                write to the client failed.
+ *                Whatever each read brings is relayed straight from the
+ *                rio buffer, and touches dl.
+ */
+static long forward_body(rio_t *rp, int fd, Fill *fill, long length, Deadline *dl)
+{
+    long total = 0, n;
+
+    while (length < 0 || total < length) {
+        if (rp->rio_cnt <= 0) {
+            if ((n = rio_fill(rp)) < 0)
+                return -1;
+            if (n == 0)
+                break;
+            deadline_touch(dl);
+        }
+        n = rp->rio_cnt;
+        if (length >= 0 && length - total < n)
+            n = length - total;
+        if (relay(fd, fill, rp->rio_bufptr, n) < 0)
+            return -1;
+        rp->rio_bufptr += n;
+        rp->rio_cnt -= n;
+        total += n;
+    }
+    return total;
+}
+
+/*
+ * forward_spliced - relay length bytes of a body too large to cache without
+ *                   copying them through user space, return the number of
+ *                   bytes relayed, -1 if a read or write failed. What the header reads
+ *                   already buffered goes first, the rest is spliced from
+ *                   the server socket.
+ */
+static long forward_spliced(rio_t *rp, int fd, Fill *fill, long length,
+                            Deadline *dl)
+{
+    long total = rp->rio_cnt < length ? rp->rio_cnt : length;
+    ssize_t n;
+
+    if (relay(fd, fill, rp->rio_bufptr, total) < 0)
+        return -1;
+    rp->rio_bufptr += total;
+    rp->rio_cnt -= total;
+    if (total < length) {
+        if ((n = splice_relay(rp->rio_fd, fd, length - total, dl)) >= 0)
+            fill->len += n;  /* Counted like the bytes of a dropped fill */
+        else if ((n = forward_body(rp, fd, fill, length - total, dl)) < 0)
+            return -1;
+        total += n;
+    }
+    return total;
+}
+
+/*
+ * forward_chunked - relay a chunked body up to and including its trailer,
+ *                   return 0 if it was complete, -1 if not. Only the data
+ *                   goes into the fill. The chunk sizes and the trailer go
+ *                   to the client unless dechunk, when it gets the data
+ *                   alone.
+ */
+static int forward_chunked(rio_t *rp, int fd, Fill *fill, int dechunk,
+                           Deadline *dl)
 {
     char buf[MAXLINE];
-    size_t n, count = 0;
-
-    // 计算 buf 中内容大小时，可以直接使用 n
-    while ((n = Rio_readlineb(rp, buf, MAXLINE)) > 0) {
-        count += n;
-        if (count <= MAX_OBJECT_SIZE)
-            strncat(cbuf, buf, n);
-        Rio_writen(fd, buf, n);
+    int framing = dechunk ? -1 : fd;
+    ssize_t n;
+    long size;
+
+    while ((n = rio_readlineb(rp, buf, MAXLINE)) > 0) {
+        if (relay(framing, NULL, buf, n) < 0)
+            return -1;
+        if ((size = strtol(buf, NULL, 16)) < 0)
+            return -1;
+        if (size == 0) {
+            /* Trailer ends with an empty line */
+            while ((n = rio_readlineb(rp, buf, MAXLINE)) > 0) {
+                if (relay(framing, NULL, buf, n) < 0)
+                    return -1;
+                if (!strcmp(buf, "\r\n"))
+                    return 0;
+            }
+            return -1;
+        }
+        /* Chunk data, then its CRLF */
+        if (forward_body(rp, fd, fill, size, dl) < size ||
+            (n = rio_readlineb(rp, buf, MAXLINE)) <= 0 ||
+            relay(framing, NULL, buf, n) < 0)
+            return -1;
     }
+    return -1;
+}
+
+/*
+ * forward_response - read and forward HTTP response in large chunks, tee it
+ *                    into fill while it fits, return the status code. The body is
+ *                    framed by Content-Length or chunked encoding, keepalive
+ *                    tells whether the server connection can be reused and
+ *                    framed whether the client can find the end of it, and
+ *                    complete whether all of it arrived, up to its frame or
+ *                    to the server closing an unframed one. A response
+ *                    the client stopped taking is neither. A 304
+ *                    to our own revalidation is only read into fill.
+ *                    firstByte is when the status line arrived. Reading
+ *                    the body touches dl.
+ *
+ *                    Hop-by-hop headers are left out. A chunked body is
+ *                    kept de-chunked in fill, which is given its length,
+ *                    so that the cached copy suits HTTP/1.0 clients too.
+ *                    If dechunk, the client gets it de-chunked as well,
+ *                    and unframed.
+ */
+/* $begin forward_response */
+int forward_response(rio_t *rp, int fd, Fill *fill, int *keepalive, int *framed,
+                     int *complete, int revalidate, int dechunk, long *firstByte,
+                     Deadline *dl)
+{
+    char buf[MAXLINE], version[MAXLINE];
+    ssize_t n;
+    size_t headEnd = 0;
+    long length = -1;
+    int status = 0, chunked = 0, toClient, toFill;
+
+    *keepalive = *framed = *complete = 0;
+    if ((n = rio_readlineb(rp, buf, MAXLINE)) <= 0)
+        return 0;
+    *firstByte = alog_now();
+    if (sscanf(buf, "%s %d", version, &status) != 2) {
+        relay(fd, fill, buf, n);
+        return 0;
+    }
+    if (revalidate && status == 304)
+        fd = -1;
+    if (relay(fd, fill, buf, n) < 0)
+        return status;
+    *keepalive = !strcasecmp(version, "HTTP/1.1");
 
-    return count;
+    // 响应头逐行读取，计算大小时直接使用 n；body 按块读取，可能含有'\0'
+    while ((n = rio_readlineb(rp, buf, MAXLINE)) > 0) {
+        toClient = toFill = 1;
+        if (!strcmp(buf, "\r\n"))
+            headEnd = fill->len;
+        else if (!strncasecmp(buf, "Content-Length:", 15))
+            length = atol(buf + 15);
+        else if (!strncasecmp(buf, "Transfer-Encoding:", 18) &&
+                 hasToken(buf + 18, "chunked")) {
+            chunked = 1;
+            toClient = !dechunk;
+            toFill = 0;
+        }
+        else if (!strncasecmp(buf, "Connection:", 11)) {
+            if (hasToken(buf + 11, "close"))
+                *keepalive = 0;
+            else if (hasToken(buf + 11, "keep-alive"))
+                *keepalive = 1;
+            toClient = toFill = 0;
+        }
+        else if (!strncasecmp(buf, "Keep-Alive:", 11) ||
+                 !strncasecmp(buf, "Proxy-Connection:", 17))
+            toClient = toFill = 0;
+        if (relay(toClient ? fd : -1, toFill ? fill : NULL, buf, n) < 0) {
+            *keepalive = 0;
+            return status;
+        }
+        if (!strcmp(buf, "\r\n"))
+            break;
+    }
+    if (n <= 0) {
+        *keepalive = 0;
+        return 0;
+    }
+
+    /* Known to be too large, don't bother copying it */
+    int large = length >= 0 && fill->len + length > fill->limit;
+    if (large)
+        dropFill(fill);
+
+    *framed = *complete = 1;
+    if (status / 100 == 1 || status == 204 || status == 304)
+        ;  /* No body */
+    else if (chunked) {
+        if (forward_chunked(rp, fd, fill, dechunk, dl) < 0)
+            *keepalive = *framed = *complete = 0;
+        else {
+            /* Frame the de-chunked copy by its length */
+            sprintf(buf, "Content-Length: %zu\r\n", fill->len - headEnd - 2);
+            insertFill(fill, headEnd, buf, strlen(buf));
+            if (dechunk)
+                *framed = 0;  /* The client reads up to the close */
+        }
+    }
+    else if (length >= 0) {
+        if ((large && fd >= 0 ? forward_spliced(rp, fd, fill, length, dl) :
+             forward_body(rp, fd, fill, length, dl)) < length)
+            *keepalive = *framed = *complete = 0;
+    }
+    else {
+        /* Not framed, the body ends when the server closes */
+        *complete = forward_body(rp, fd, fill, -1, dl) >= 0;
+        *keepalive = *framed = 0;
+    }
+
+    return status;
 }
 /* $end forward_response */
 
@@ -261,24 +845,23 @@ size_t forward_response(rio_t *rp, int fd, char *cbuf)
 void clienterror(int fd, char *cause, char *errnum, 
 		 char *shortmsg, char *longmsg) 
 {
-    char buf[MAXLINE];
+    rio_writer_t out;
+
+    /* The client may be gone, which must not take the proxy down, so
+       errors are ignored */
+    rio_writeinitb(&out, fd);
 
     /* Print the HTTP response headers */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    rio_printfb(&out, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
+    rio_printfb(&out, "Content-type: text/html\r\n\r\n");
 
     /* Print the HTTP response body */
-    sprintf(buf, "<html><title>Proxy Error</title>");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<body bgcolor=""ffffff"">\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "%s: %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<p>%s: %s\r\n", longmsg, cause);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<hr><em>The Proxy Web server</em>\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    rio_printfb(&out, "<html><title>Proxy Error</title>");
+    rio_printfb(&out, "<body bgcolor=""ffffff"">\r\n");
+    rio_printfb(&out, "%s: %s\r\n", errnum, shortmsg);
+    rio_printfb(&out, "<p>%s: ", longmsg);
+    rio_writeb(&out, cause, strlen(cause));
+    rio_printfb(&out, "\r\n<hr><em>The Proxy Web server</em>\r\n");
+    rio_flushb(&out);
 }
 /* $end clienterror */
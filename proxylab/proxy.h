@@ -0,0 +1,23 @@
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include "csapp.h"
+#include "cache.h"
+#include "dns.h"
+#include "timer.h"
+
+#ifndef CLIENT_TIMEOUT_MS
+#define CLIENT_TIMEOUT_MS 10000  /* Most a client may take to send a request head,
+                                    or stall a write of the response */
+#endif
+#ifndef UPSTREAM_TIMEOUT_MS
+#define UPSTREAM_TIMEOUT_MS 30000  /* Most a server may take to connect or stay silent */
+#endif
+
+/* Shared by the threaded and event-driven front ends */
+extern const char *user_agent_hdr;
+extern Cache proxyCache;
+extern DnsCache dnsCache;
+extern TimerWheel timers;
+
+#endif
@@ -1,15 +1,37 @@
+/*
+ * sbuf.c - bounded, shared FIFO buffer without locks
+ *
+ * Producers and consumers claim positions with a compare-and-swap on rear
+ * and front, the per-slot sequence number tells whether the slot at a
+ * position is ready. Threads only sleep, on a futex, when the buffer is
+ * empty or full.
+ */
+#include <linux/futex.h>
+#include <sys/syscall.h>
 #include "csapp.h"
 #include "sbuf.h"
 
+/* Sleep while *addr == val, at most timeout if it is not NULL */
+static void futex_wait(int *addr, int val, struct timespec *timeout)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+
+static void futex_wake(int *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
 /* Create an empty, bounded, shared FIFO buffer with n slots */
 void sbuf_init(sbuf_t *sp, int n)
 {
-    sp->buf = Calloc(n, sizeof(int));
+    sp->buf = Calloc(n, sizeof(sbuf_slot_t));
     sp->n = n;                      /* Buffer holds max of n items */
+    for (int i = 0; i < n; i++)
+        sp->buf[i].seq = i;         /* Initially, every slot is free */
     sp->front = sp->rear = 0;       /* Empty buffer iff front == rear */
-    Sem_init(&sp->mutex, 0, 1);     /* Binary semaphore for locking */
-    Sem_init(&sp->slots, 0, n);     /* Initially, buf has n empty slots */
-    Sem_init(&sp->items, 0, 0);     /* Initially, buf has zero data items */
+    sp->items = sp->slots = 0;
+    sp->itemWaiters = sp->slotWaiters = 0;
 }
 
 /* Clean up buffer sp */
@@ -18,24 +40,137 @@ void sbuf_deinit(sbuf_t *sp)
     Free(sp->buf);
 }
 
+/* Insert item if a slot is free, return 0 if the buffer is full */
+static int try_insert(sbuf_t *sp, int item)
+{
+    unsigned long pos = __atomic_load_n(&sp->rear, __ATOMIC_RELAXED);
+
+    while (1) {
+        sbuf_slot_t *slot = &sp->buf[pos % sp->n];
+        long diff = (long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+
+        if (diff == 0) {
+            /* Free, claim the position */
+            if (__atomic_compare_exchange_n(&sp->rear, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                slot->item = item;
+                __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+                return 1;
+            }
+        }
+        else if (diff < 0)
+            return 0;               /* Still holds the item of the last lap */
+        else
+            pos = __atomic_load_n(&sp->rear, __ATOMIC_RELAXED);
+    }
+}
+
+/* Remove the first item into *item, return 0 if the buffer is empty */
+static int try_remove(sbuf_t *sp, int *item)
+{
+    unsigned long pos = __atomic_load_n(&sp->front, __ATOMIC_RELAXED);
+
+    while (1) {
+        sbuf_slot_t *slot = &sp->buf[pos % sp->n];
+        long diff = (long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&sp->front, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *item = slot->item;
+                /* Free the slot for the producer one lap later */
+                __atomic_store_n(&slot->seq, pos + sp->n, __ATOMIC_RELEASE);
+                return 1;
+            }
+        }
+        else if (diff < 0)
+            return 0;               /* Not inserted yet */
+        else
+            pos = __atomic_load_n(&sp->front, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Announce an event on the futex word and wake a sleeper if there is one.
+ * A sleeper registers before its last try, so either it sees our change
+ * or we see it registered.
+ */
+static void signal_event(int *word, int *waiters)
+{
+    __atomic_add_fetch(word, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST) > 0)
+        futex_wake(word);
+}
+
 /* Insert item onto the rear of shared buffer sp */
 void sbuf_insert(sbuf_t *sp, int item)
 {
-    P(&sp->slots);                              /* Wait for available slot */
-    P(&sp->mutex);                              /* Lock the buffer */
-    sp->buf[(++sp->rear) % (sp->n)] = item;     /* Insert the item */
-    V(&sp->mutex);                              /* Unlock the buffer */
-    V(&sp->items);                              /* Announce available item */
+    while (!try_insert(sp, item)) {
+        /* Full, sleep until a consumer frees a slot */
+        __atomic_add_fetch(&sp->slotWaiters, 1, __ATOMIC_SEQ_CST);
+        int seen = __atomic_load_n(&sp->slots, __ATOMIC_SEQ_CST);
+        if (!try_insert(sp, item)) {
+            futex_wait(&sp->slots, seen, NULL);
+            __atomic_sub_fetch(&sp->slotWaiters, 1, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        __atomic_sub_fetch(&sp->slotWaiters, 1, __ATOMIC_SEQ_CST);
+        break;
+    }
+    signal_event(&sp->items, &sp->itemWaiters);    /* Announce available item */
+}
+
+static long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Remove the first item from buffer sp into *item, waiting at most ms
+ * milliseconds for one if ms >= 0. Return 0 if none came in time.
+ */
+int sbuf_remove_timed(sbuf_t *sp, int ms, int *item)
+{
+    long deadline = now_ms() + ms;
+    struct timespec timeout;
+
+    while (!try_remove(sp, item)) {
+        /* Empty, sleep until a producer inserts */
+        long left = deadline - now_ms();
+        if (ms >= 0 && left <= 0)
+            return 0;
+        timeout.tv_sec = left / 1000;
+        timeout.tv_nsec = left % 1000 * 1000000;
+
+        __atomic_add_fetch(&sp->itemWaiters, 1, __ATOMIC_SEQ_CST);
+        int seen = __atomic_load_n(&sp->items, __ATOMIC_SEQ_CST);
+        if (!try_remove(sp, item)) {
+            futex_wait(&sp->items, seen, ms >= 0 ? &timeout : NULL);
+            __atomic_sub_fetch(&sp->itemWaiters, 1, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        __atomic_sub_fetch(&sp->itemWaiters, 1, __ATOMIC_SEQ_CST);
+        break;
+    }
+    signal_event(&sp->slots, &sp->slotWaiters);    /* Announce available slot */
+    return 1;
 }
 
 /* Remove and return the first item from buffer sp */
 int sbuf_remove(sbuf_t *sp)
 {
     int item;
-    P(&sp->items);                              /* Wait for available item */
-    P(&sp->mutex);                              /* Lock the buffer */
-    item = sp->buf[(++sp->front) % (sp->n)];    /* Remove the item */
-    V(&sp->mutex);                              /* Unlock the buffer */
-    V(&sp->slots);                              /* Announce available slot */
+
+    sbuf_remove_timed(sp, -1, &item);
     return item;
-}
\ No newline at end of file
+}
+
+/* Number of items in the buffer, a snapshot */
+int sbuf_count(sbuf_t *sp)
+{
+    long n = (long)(__atomic_load_n(&sp->rear, __ATOMIC_RELAXED) -
+                    __atomic_load_n(&sp->front, __ATOMIC_RELAXED));
+    return n < 0 ? 0 : (int)n;
+}
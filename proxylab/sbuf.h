@@ -1,16 +1,26 @@
 #include "csapp.h"
 
+/* A slot is free for the producer at position pos when seq == pos, and
+   holds an item for the consumer at position pos when seq == pos + 1 */
 typedef struct {
-    int *buf;       /* Buffer array */
-    int n;          /* Maximum number of slots */
-    int front;      /* buf[(front+1)%n] is first item */
-    int rear;       /* buf[rear%n] is last item */
-    sem_t mutex;    /* Protects accesses to buf */
-    sem_t slots;    /* Counts available slots */
-    sem_t items;    /* Counts available items */
+    unsigned long seq;
+    int item;
+} sbuf_slot_t;
+
+typedef struct {
+    sbuf_slot_t *buf;    /* Buffer array */
+    int n;               /* Maximum number of slots */
+    unsigned long front __attribute__((aligned(64)));  /* Next to remove */
+    unsigned long rear __attribute__((aligned(64)));   /* Next to insert */
+    int items __attribute__((aligned(64)));  /* Futex bumped per insert */
+    int itemWaiters;     /* Consumers asleep on items */
+    int slots __attribute__((aligned(64)));  /* Futex bumped per remove */
+    int slotWaiters;     /* Producers asleep on slots */
 } sbuf_t;
 
 void sbuf_init(sbuf_t *sp, int n);
 void sbuf_deinit(sbuf_t *sp);
 void sbuf_insert(sbuf_t *sp, int item);
-int sbuf_remove(sbuf_t *sp);
\ No newline at end of file
+int sbuf_remove(sbuf_t *sp);
+int sbuf_remove_timed(sbuf_t *sp, int ms, int *item);
+int sbuf_count(sbuf_t *sp);
@@ -0,0 +1,123 @@
+/*
+ * sbufbench.c - throughput of the shared buffer of connected descriptors
+ *
+ * P producers insert and C consumers remove items as fast as they can, for
+ * P and C in 1, 2, 4, ... up to maxthreads. The lock-free sbuf is compared
+ * with the semaphore version it replaced, which is kept here as semsbuf.
+ *
+ * usage: ./sbufbench [maxthreads] [items per producer]
+ */
+#include "csapp.h"
+#include "sbuf.h"
+
+#define SBUFSIZE 16
+
+/* The semaphore buffer from the textbook */
+typedef struct {
+    int *buf;
+    int n;
+    int front;
+    int rear;
+    sem_t mutex;
+    sem_t slots;
+    sem_t items;
+} semsbuf_t;
+
+static void semsbuf_init(semsbuf_t *sp, int n)
+{
+    sp->buf = Calloc(n, sizeof(int));
+    sp->n = n;
+    sp->front = sp->rear = 0;
+    Sem_init(&sp->mutex, 0, 1);
+    Sem_init(&sp->slots, 0, n);
+    Sem_init(&sp->items, 0, 0);
+}
+
+static void semsbuf_insert(semsbuf_t *sp, int item)
+{
+    P(&sp->slots);
+    P(&sp->mutex);
+    sp->buf[(++sp->rear) % (sp->n)] = item;
+    V(&sp->mutex);
+    V(&sp->items);
+}
+
+static int semsbuf_remove(semsbuf_t *sp)
+{
+    int item;
+    P(&sp->items);
+    P(&sp->mutex);
+    item = sp->buf[(++sp->front) % (sp->n)];
+    V(&sp->mutex);
+    V(&sp->slots);
+    return item;
+}
+
+static sbuf_t sbuf;
+static semsbuf_t semsbuf;
+static int useSem;
+static long nitems, perConsumer;
+
+static void* producer(void *vargp)
+{
+    for (long i = 0; i < nitems; i++)
+        if (useSem)
+            semsbuf_insert(&semsbuf, (int)i);
+        else
+            sbuf_insert(&sbuf, (int)i);
+    return NULL;
+}
+
+static void* consumer(void *vargp)
+{
+    long sum = 0;
+    for (long i = 0; i < perConsumer; i++)
+        sum += useSem ? semsbuf_remove(&semsbuf) : sbuf_remove(&sbuf);
+    return (void *)sum;
+}
+
+static double run(int np, int nc)
+{
+    pthread_t tids[np + nc];
+    struct timeval start, end;
+    long sum = 0, expect = nitems * (nitems - 1) / 2 * np;
+    void *ret;
+
+    perConsumer = nitems * np / nc;
+    gettimeofday(&start, NULL);
+    for (int i = 0; i < nc; i++)
+        Pthread_create(&tids[i], NULL, consumer, NULL);
+    for (int i = 0; i < np; i++)
+        Pthread_create(&tids[nc + i], NULL, producer, NULL);
+    for (int i = 0; i < np + nc; i++) {
+        Pthread_join(tids[i], &ret);
+        if (i < nc)
+            sum += (long)ret;
+    }
+    gettimeofday(&end, NULL);
+
+    if (sum != expect)
+        app_error("items lost or duplicated");
+    return nitems * np / ((end.tv_sec - start.tv_sec) +
+                          (end.tv_usec - start.tv_usec) / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+    int maxthreads = argc > 1 ? atoi(argv[1]) : 4;
+    nitems = argc > 2 ? atol(argv[2]) : 1 << 20;
+
+    sbuf_init(&sbuf, SBUFSIZE);
+    semsbuf_init(&semsbuf, SBUFSIZE);
+    printf("slots: %d  items per producer: %ld\n", SBUFSIZE, nitems);
+    for (int np = 1; np <= maxthreads; np *= 2)
+        for (int nc = 1; nc <= maxthreads; nc *= 2) {
+            useSem = 1;
+            double sem = run(np, nc);
+            useSem = 0;
+            double lockfree = run(np, nc);
+            printf("producers: %2d  consumers: %2d  semaphore: %10.0f/s  "
+                   "lock-free: %10.0f/s\n", np, nc, sem, lockfree);
+        }
+    return 0;
+}
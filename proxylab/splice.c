@@ -0,0 +1,70 @@
+/*
+ * splice.c - relay bytes between sockets without copying them to user space
+ *
+ * A socket can't be spliced straight into another, so the bytes go from
+ * the server socket into a pipe and from the pipe to the client socket.
+ * Only the pages of the socket buffers move, the proxy never touches them.
+ */
+#include <sys/syscall.h>
+#include "splice.h"
+
+/* Declared by fcntl.h only with _GNU_SOURCE */
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_MOVE 1
+#define SPLICE_F_MORE 4
+#endif
+
+static ssize_t sys_splice(int in, int out, size_t len, unsigned int flags)
+{
+    return syscall(SYS_splice, in, NULL, out, NULL, len, flags);
+}
+
+/*
+ * splice_relay - move len bytes from in to out, return how many reached out,
+ *                or -1 if splice can't be used and nothing was moved. The
+ *                pipe is made per call, the bodies worth it are large.
+ *                Each piece read from in touches dl if it is not NULL.
+ */
+ssize_t splice_relay(int in, int out, size_t len, Deadline *dl)
+{
+    int p[2];
+    size_t total = 0, inpipe;
+    ssize_t n;
+
+    if (pipe(p) < 0)
+        return -1;
+    while (total < len) {
+        /* Fill the pipe from in, it ends early on EOF or error */
+        size_t want = len - total < SPLICE_CHUNK ? len - total : SPLICE_CHUNK;
+        if ((n = sys_splice(in, p[1], want, SPLICE_F_MOVE | SPLICE_F_MORE)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (total == 0 && (errno == EINVAL || errno == ENOSYS)) {
+                /* Not supported for these descriptors */
+                close(p[0]);
+                close(p[1]);
+                return -1;
+            }
+        }
+        if (n <= 0)
+            break;
+        if (dl != NULL)
+            deadline_touch(dl);
+
+        /* Drain it to out, telling TCP whether more follows */
+        for (inpipe = n; inpipe > 0; ) {
+            n = sys_splice(p[0], out, inpipe, SPLICE_F_MOVE |
+                           (total + inpipe < len ? SPLICE_F_MORE : 0));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                goto done;
+            inpipe -= n;
+            total += n;
+        }
+    }
+ done:
+    close(p[0]);
+    close(p[1]);
+    return total;
+}
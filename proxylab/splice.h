@@ -0,0 +1,12 @@
+#ifndef __SPLICE_H__
+#define __SPLICE_H__
+
+#include "csapp.h"
+#include "timer.h"
+
+/* Bytes moved through the pipe per splice call */
+#define SPLICE_CHUNK (1 << 16)
+
+ssize_t splice_relay(int in, int out, size_t len, Deadline *dl);
+
+#endif
@@ -0,0 +1,210 @@
+/*
+ * stats.c - counters and latency histograms, summed when asked for
+ *
+ * Each thread counts into a shard of its own, so recording a request is a
+ * handful of plain stores into memory no other thread writes. A stats page
+ * sums all shards. Latencies go into log-linear buckets like an HDR
+ * histogram, each bucket within 1/STATS_SUB of its value.
+ */
+#include "stats.h"
+
+static StatsShard *shards;     /* Only ever prepended to */
+static sem_t mutex;            /* Protects shards */
+static pthread_key_t shardKey;
+static __thread StatsShard *myShard;
+static long started;
+
+static void releaseShard(void *arg)
+{
+    __atomic_store_n(&((StatsShard *)arg)->owned, 0, __ATOMIC_RELEASE);
+}
+
+static StatsShard* claimShard(void)
+{
+    StatsShard *s;
+    int unowned;
+
+    P(&mutex);
+    for (s = shards; s != NULL; s = s->next)
+    {
+        unowned = 0;
+        if (__atomic_compare_exchange_n(&s->owned, &unowned, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if (s == NULL)
+    {
+        s = Calloc(1, sizeof(StatsShard));
+        s->owned = 1;
+        s->next = shards;
+        shards = s;
+    }
+    V(&mutex);
+    pthread_setspecific(shardKey, s);
+    return s;
+}
+
+/* Only the owner adds, readers may see a count one behind */
+static void add(unsigned long *counter, unsigned long n)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELAXED);
+}
+
+static int bucketOf(unsigned long v)
+{
+    int shift;
+
+    if (v < STATS_SUB)
+        return v;
+    if (v >= 1UL << STATS_MAX_BITS)
+        v = (1UL << STATS_MAX_BITS) - 1;
+    shift = 63 - __builtin_clzl(v) - STATS_SUB_BITS;
+    return (shift + 1) * STATS_SUB + ((v >> shift) & (STATS_SUB - 1));
+}
+
+/* Largest value that falls into bucket i */
+static unsigned long bucketTop(int i)
+{
+    int shift;
+
+    if (i < STATS_SUB)
+        return i;
+    shift = i / STATS_SUB - 1;
+    return ((unsigned long)(STATS_SUB + i % STATS_SUB) << shift) + (1UL << shift) - 1;
+}
+
+void stats_init(void)
+{
+    Sem_init(&mutex, 0, 1);
+    if (pthread_key_create(&shardKey, releaseShard) != 0)
+        app_error("pthread_key_create error");
+    started = alog_now();
+}
+
+/* Count a finished request */
+void stats_record(const AccessRecord *rec)
+{
+    StatsShard *s;
+    unsigned long latency;
+
+    if (rec->request[0] == '\0')
+        return;
+    if ((s = myShard) == NULL)
+        s = myShard = claimShard();
+
+    latency = (rec->done ? rec->done : alog_now()) - rec->accept;
+    add(&s->counters[STAT_REQUESTS], 1);
+    add(&s->latency[bucketOf(latency)], 1);
+    if (latency > s->maxLatency)
+        __atomic_store_n(&s->maxLatency, latency, __ATOMIC_RELAXED);
+    if (rec->status >= 400)
+        add(&s->counters[STAT_ERRORS], 1);
+
+    switch (rec->cache)
+    {
+    case ALOG_HIT:
+        add(&s->counters[STAT_HITS], 1);
+        add(&s->counters[STAT_CACHE_BYTES], rec->bytes);
+        break;
+    case ALOG_DISK:
+        add(&s->counters[STAT_DISK_HITS], 1);
+        add(&s->counters[STAT_CACHE_BYTES], rec->bytes);
+        break;
+    case ALOG_REVALIDATED:
+        add(&s->counters[STAT_REVALIDATED], 1);
+        add(&s->counters[STAT_CACHE_BYTES], rec->bytes);
+        break;
+    case ALOG_MISS:
+        add(&s->counters[STAT_MISSES], 1);
+        add(&s->counters[STAT_ORIGIN_BYTES], rec->bytes);
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * Smallest bucket top at or above fraction q of the n latencies, but no
+ * more than the largest latency seen, max
+ */
+static unsigned long percentile(unsigned long *latency, unsigned long n, double q,
+                                unsigned long max)
+{
+    unsigned long want = (unsigned long)(q * n + 0.5), seen = 0;
+
+    if (want == 0)
+        want = 1;
+    for (int i = 0; i < STATS_NBUCKETS; i++)
+        if ((seen += latency[i]) >= want)
+            return bucketTop(i) < max ? bucketTop(i) : max;
+    return max;
+}
+
+/*
+ * stats_page - write a response with the sums of all shards as JSON into
+ *              buf, extra members are added to the object as given.
+ *              Return its length.
+ */
+size_t stats_page(char *buf, size_t size, const char *extra)
+{
+    static const char *names[] = { "requests", "hits", "disk_hits",
+        "revalidated", "misses", "errors", "bytes_from_cache",
+        "bytes_from_origin" };
+    unsigned long counters[STAT_NCOUNTERS] = { 0 }, latency[STATS_NBUCKETS] = { 0 };
+    unsigned long max = 0, served, head, m;
+    char body[STATS_PAGE_SIZE];
+    size_t n = 0, room = sizeof(body) - 4;
+    StatsShard *s;
+
+    P(&mutex);
+    s = shards;
+    V(&mutex);
+    for (; s != NULL; s = s->next)
+    {
+        for (int i = 0; i < STAT_NCOUNTERS; i++)
+            counters[i] += __atomic_load_n(&s->counters[i], __ATOMIC_RELAXED);
+        for (int i = 0; i < STATS_NBUCKETS; i++)
+            latency[i] += __atomic_load_n(&s->latency[i], __ATOMIC_RELAXED);
+        if ((m = __atomic_load_n(&s->maxLatency, __ATOMIC_RELAXED)) > max)
+            max = m;
+    }
+
+    /* Requests not served from cache or server are left out of the ratio */
+    served = counters[STAT_HITS] + counters[STAT_DISK_HITS] +
+             counters[STAT_REVALIDATED] + counters[STAT_MISSES];
+    n += snprintf(body + n, room - n, "{\"uptime_s\":%ld",
+                  (alog_now() - started) / 1000000);
+    for (int i = 0; i < STAT_NCOUNTERS; i++)
+        n += snprintf(body + n, room - n, ",\"%s\":%lu", names[i], counters[i]);
+    n += snprintf(body + n, room - n, ",\"hit_ratio\":%.4f",
+                  served ? (double)(served - counters[STAT_MISSES]) / served : 0.0);
+    if (extra != NULL)
+        n += snprintf(body + n, room - n, ",%s", extra);
+
+    /* Counts per bucket, by the bucket's largest latency */
+    n += snprintf(body + n, room - n, ",\"latency_us\":{\"p50\":%lu,\"p90\":%lu,"
+                  "\"p99\":%lu,\"p999\":%lu,\"max\":%lu,\"buckets\":[",
+                  percentile(latency, counters[STAT_REQUESTS], 0.5, max),
+                  percentile(latency, counters[STAT_REQUESTS], 0.9, max),
+                  percentile(latency, counters[STAT_REQUESTS], 0.99, max),
+                  percentile(latency, counters[STAT_REQUESTS], 0.999, max),
+                  max);
+    for (int i = 0, first = 1; i < STATS_NBUCKETS && n < room - 64; i++)
+        if (latency[i] > 0)
+        {
+            n += snprintf(body + n, room - n, "%s[%lu,%lu]", first ? "" : ",",
+                          bucketTop(i), latency[i]);
+            first = 0;
+        }
+    n += sprintf(body + n, "]}}\n");
+
+    head = snprintf(buf, size, "HTTP/1.0 200 OK\r\n"
+                    "Content-Type: application/json\r\n"
+                    "Cache-Control: no-store\r\n"
+                    "Content-Length: %zu\r\n\r\n", n);
+    if (head + n > size)
+        n = size - head;
+    memcpy(buf + head, body, n);
+    return head + n;
+}
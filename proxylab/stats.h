@@ -0,0 +1,42 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "csapp.h"
+#include "alog.h"
+
+/* Asked of the proxy itself, not proxied */
+#define STATS_URI "/__stats"
+#define STATS_PAGE_SIZE 8192    /* Most bytes of JSON, without the headers */
+
+/* Latencies in microseconds, 2^STATS_SUB_BITS buckets per power of two */
+#define STATS_SUB_BITS 3
+#define STATS_SUB (1 << STATS_SUB_BITS)
+#define STATS_MAX_BITS 40
+#define STATS_NBUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 1) * STATS_SUB + STATS_SUB)
+
+typedef enum {
+    STAT_REQUESTS,
+    STAT_HITS,
+    STAT_DISK_HITS,
+    STAT_REVALIDATED,
+    STAT_MISSES,
+    STAT_ERRORS,               /* Answered with a 4xx or 5xx */
+    STAT_CACHE_BYTES,          /* Sent from memory or disk */
+    STAT_ORIGIN_BYTES,         /* Relayed from servers */
+    STAT_NCOUNTERS
+} StatCounter;
+
+/* Counters of one thread, only it writes them */
+typedef struct StatsShard {
+    unsigned long counters[STAT_NCOUNTERS];
+    unsigned long latency[STATS_NBUCKETS];
+    unsigned long maxLatency;
+    int owned;                 /* Has a thread counting into it */
+    struct StatsShard *next;
+} StatsShard;
+
+void stats_init(void);
+void stats_record(const AccessRecord *rec);
+size_t stats_page(char *buf, size_t size, const char *extra);
+
+#endif
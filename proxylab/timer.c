@@ -0,0 +1,290 @@
+/*
+ * timer.c - hierarchical timing wheel and I/O deadlines
+ *
+ * A timer due within TIMER_SLOTS ticks sits in the level 0 slot of its
+ * tick. One due later sits in a coarser level, in the slot covering its
+ * tick. Whenever the ticks of a level wrap around, the next slot of the
+ * level above is emptied and its timers are put back, now at a finer
+ * level. Adding and cancelling are O(1), a tick fires only what is due.
+ *
+ * A wheel is advanced either by a thread of its own, for threads blocked
+ * in I/O, or by an event loop that owns it and runs the ticks that have
+ * passed whenever it wakes up.
+ */
+#include "timer.h"
+
+#define SLOT_MASK (TIMER_SLOTS - 1)
+
+static long micros(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* Put t in the slot for its tick, the wheel is locked */
+static void link_timer(TimerWheel *tw, Timer *t)
+{
+    unsigned long delta;
+    Timer **slot;
+    int level = 0;
+
+    /* Already due fires on the next tick, too far waits at the last level */
+    if ((long)(t->expires - tw->now) < 0)
+        t->expires = tw->now;
+    if ((t->expires - tw->now) >> (TIMER_BITS * TIMER_LEVELS))
+        t->expires = tw->now + (1UL << (TIMER_BITS * TIMER_LEVELS)) - 1;
+    delta = t->expires - tw->now;
+    while (level < TIMER_LEVELS - 1 && delta >> (TIMER_BITS * (level + 1)))
+        level++;
+
+    slot = &tw->slots[level][(t->expires >> (TIMER_BITS * level)) & SLOT_MASK];
+    if ((t->next = *slot) != NULL)
+        t->next->pprev = &t->next;
+    t->pprev = slot;
+    *slot = t;
+}
+
+static void unlink_timer(TimerWheel *tw, Timer *t)
+{
+    if ((*t->pprev = t->next) != NULL)
+        t->next->pprev = t->pprev;
+    t->pprev = NULL;
+    tw->npending--;
+}
+
+/* Put the timers of the current slot of a level back at finer levels */
+static void cascade(TimerWheel *tw, int level)
+{
+    Timer **slot = &tw->slots[level][(tw->now >> (TIMER_BITS * level)) & SLOT_MASK];
+    Timer *t = *slot, *next;
+
+    *slot = NULL;
+    for (; t != NULL; t = next) {
+        next = t->next;
+        link_timer(tw, t);
+    }
+}
+
+/* Fire the timers due at the current tick and move on to the next */
+static void run_tick(TimerWheel *tw)
+{
+    Timer **slot = &tw->slots[0][tw->now & SLOT_MASK];
+    Timer *t;
+
+    for (int level = 1; level < TIMER_LEVELS &&
+             !((tw->now >> (TIMER_BITS * (level - 1))) & SLOT_MASK); level++)
+        cascade(tw, level);
+    while ((t = *slot) != NULL) {
+        unlink_timer(tw, t);
+        t->fire(t);
+    }
+    tw->now++;
+}
+
+/* The tick the clock is in */
+static unsigned long current_tick(TimerWheel *tw)
+{
+    return (micros() - tw->start) / (TIMER_TICK_MS * 1000);
+}
+
+/* Run the ticks up to and including due, the wheel is locked */
+static void run_due(TimerWheel *tw, unsigned long due)
+{
+    /* Nothing to fire or cascade, skip the idle ticks at once */
+    if (tw->npending == 0 && (long)(tw->now - due) <= 0)
+        tw->now = due + 1;
+    while ((long)(tw->now - due) <= 0)
+        run_tick(tw);
+}
+
+/* Thread routine, runs the ticks that have passed every TIMER_TICK_MS */
+static void* ticker(void *vargp)
+{
+    TimerWheel *tw = vargp;
+    struct timespec ts = { 0, TIMER_TICK_MS * 1000000L };
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        nanosleep(&ts, NULL);
+        P(&tw->mutex);
+        run_due(tw, current_tick(tw));
+        V(&tw->mutex);
+    }
+    return NULL;
+}
+
+/* Start an empty wheel, advanced by whoever calls timer_run */
+void timer_setup(TimerWheel *tw)
+{
+    memset(tw->slots, 0, sizeof(tw->slots));
+    tw->now = 0;
+    tw->start = micros();
+    tw->npending = 0;
+    Sem_init(&tw->mutex, 0, 1);
+}
+
+/* Start an empty wheel and the thread that advances it */
+void timer_init(TimerWheel *tw)
+{
+    pthread_t tid;
+
+    timer_setup(tw);
+    Pthread_create(&tid, NULL, ticker, tw);
+}
+
+/*
+ * timer_run - run the ticks that have passed, firing what is due, on a
+ *             wheel without a thread. Fire must not call the timer_
+ *             functions of the wheel, it is locked.
+ */
+void timer_run(TimerWheel *tw)
+{
+    P(&tw->mutex);
+    run_due(tw, current_tick(tw));
+    V(&tw->mutex);
+}
+
+/*
+ * timer_next - milliseconds until timer_run has a timer to fire or levels
+ *              to cascade, -1 if no timer is pending
+ */
+int timer_next(TimerWheel *tw)
+{
+    unsigned long tick;
+    long us;
+
+    P(&tw->mutex);
+    if (tw->npending == 0) {
+        V(&tw->mutex);
+        return -1;
+    }
+    for (tick = tw->now; tw->slots[0][tick & SLOT_MASK] == NULL; )
+        if (!(++tick & SLOT_MASK))
+            break;
+    us = (long)tick * TIMER_TICK_MS * 1000 - (micros() - tw->start);
+    V(&tw->mutex);
+    return us > 0 ? (us + 999) / 1000 : 0;
+}
+
+static void add_locked(TimerWheel *tw, Timer *t, int ms)
+{
+    t->expires = tw->now + (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    link_timer(tw, t);
+    tw->npending++;
+}
+
+/*
+ * timer_add - fire t in at least ms. fire runs on the wheel's thread with
+ *             the wheel locked, it must be short and may add t again.
+ */
+void timer_add(TimerWheel *tw, Timer *t, int ms, void (*fire)(Timer *t))
+{
+    unsigned long tick;
+
+    t->fire = fire;
+    P(&tw->mutex);
+    /* An empty wheel may not have run for long, catch up first */
+    if (tw->npending == 0 && (long)((tick = current_tick(tw)) - tw->now) >= 0)
+        tw->now = tick + 1;
+    add_locked(tw, t, ms);
+    V(&tw->mutex);
+}
+
+/*
+ * timer_cancel - stop t unless it fired, return 1 if it was pending. Once
+ *                it returns, fire is not running and won't run.
+ */
+int timer_cancel(TimerWheel *tw, Timer *t)
+{
+    int pending;
+
+    P(&tw->mutex);
+    if ((pending = t->pprev != NULL))
+        unlink_timer(tw, t);
+    V(&tw->mutex);
+    return pending;
+}
+
+/* Expire a deadline, or give it another round if there was progress */
+static void expire(Timer *t)
+{
+    Deadline *d = (Deadline *)t;
+
+    if (__atomic_exchange_n(&d->touched, 0, __ATOMIC_RELAXED)) {
+        add_locked(d->wheel, t, d->ms);
+        return;
+    }
+    d->expired = 1;
+    if (d->fd >= 0)
+        shutdown(d->fd, d->how);
+    if (d->sem != NULL)
+        V(d->sem);
+}
+
+/* Start a deadline of ms on fd, which may be -1 until deadline_watch */
+void deadline_start(Deadline *d, TimerWheel *tw, int fd, int how, int ms)
+{
+    d->wheel = tw;
+    d->ms = ms;
+    d->fd = fd;
+    d->how = how;
+    d->expired = 0;
+    d->touched = 0;
+    d->sem = NULL;
+    timer_add(tw, &d->timer, ms, expire);
+}
+
+/*
+ * deadline_watch - move the deadline to fd, or to none if -1. Do that
+ *                  before closing the old one, whose number may be reused.
+ *                  A new fd is shut down at once if the deadline expired,
+ *                  return 1 if it did.
+ */
+int deadline_watch(Deadline *d, int fd)
+{
+    int expired;
+
+    P(&d->wheel->mutex);
+    d->fd = fd;
+    if ((expired = d->expired) && fd >= 0)
+        shutdown(fd, d->how);
+    V(&d->wheel->mutex);
+    return expired;
+}
+
+/*
+ * deadline_wait - P(sem), or stop waiting when the deadline expires and
+ *                 return 1. Then sem may still be posted by whoever else
+ *                 the caller gave it to.
+ */
+int deadline_wait(Deadline *d, sem_t *sem)
+{
+    int expired;
+
+    P(&d->wheel->mutex);
+    if (!(expired = d->expired))
+        d->sem = sem;
+    V(&d->wheel->mutex);
+    if (expired)
+        return 1;
+    P(sem);
+    P(&d->wheel->mutex);
+    d->sem = NULL;
+    expired = d->expired;
+    V(&d->wheel->mutex);
+    return expired;
+}
+
+/* Note progress, lock free, the deadline is extended when it comes */
+void deadline_touch(Deadline *d)
+{
+    __atomic_store_n(&d->touched, 1, __ATOMIC_RELAXED);
+}
+
+/* Cancel the deadline, return 1 if it had expired */
+int deadline_stop(Deadline *d)
+{
+    timer_cancel(d->wheel, &d->timer);
+    return d->expired;
+}
@@ -0,0 +1,60 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include "csapp.h"
+
+/* The wheel advances every TIMER_TICK_MS. A slot of level l spans
+   TIMER_SLOTS^l ticks, so the levels cover about 46 hours. */
+#define TIMER_TICK_MS 10
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_LEVELS 4
+
+typedef struct Timer {
+    unsigned long expires;     /* Tick it fires at */
+    void (*fire)(struct Timer *t);
+    struct Timer *next;        /* Next timer in the same slot */
+    struct Timer **pprev;      /* Link pointing to it, NULL unless pending */
+} Timer;
+
+/* Hierarchical timing wheel, advanced by its own thread or its owner */
+typedef struct {
+    Timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+    unsigned long now;         /* Next tick to run */
+    long start;                /* Microseconds when tick 0 was */
+    int npending;              /* Timers in the slots */
+    sem_t mutex;               /* Protects all of the above, held while firing */
+} TimerWheel;
+
+/*
+ * A deadline on the blocking I/O of one descriptor. When it expires the
+ * descriptor is shut down, which wakes whoever is blocked on it, and a
+ * thread in deadline_wait is woken too. Each touch extends it by its
+ * whole length once more, checked only when it would have expired, so it
+ * bounds the time without progress.
+ */
+typedef struct {
+    Timer timer;
+    TimerWheel *wheel;
+    int ms;
+    int fd;                    /* -1 while there is none */
+    int how;                   /* SHUT_RD, or SHUT_RDWR */
+    int expired;
+    int touched;               /* Progress since last armed */
+    sem_t *sem;                /* Posted on expiry, set by deadline_wait */
+} Deadline;
+
+void timer_init(TimerWheel *tw);
+void timer_setup(TimerWheel *tw);
+void timer_run(TimerWheel *tw);
+int timer_next(TimerWheel *tw);
+void timer_add(TimerWheel *tw, Timer *t, int ms, void (*fire)(Timer *t));
+int timer_cancel(TimerWheel *tw, Timer *t);
+
+void deadline_start(Deadline *d, TimerWheel *tw, int fd, int how, int ms);
+int deadline_watch(Deadline *d, int fd);
+int deadline_wait(Deadline *d, sem_t *sem);
+void deadline_touch(Deadline *d);
+int deadline_stop(Deadline *d);
+
+#endif
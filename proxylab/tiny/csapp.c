@@ -893,6 +893,107 @@ ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
 }
 /* $end rio_readlineb */
 
+/*
+ * rio_writeinitb - Start an empty batch of output for a descriptor
+ */
+void rio_writeinitb(rio_writer_t *wp, int fd)
+{
+    wp->rio_fd = fd;
+    wp->rio_iovcnt = 0;
+    wp->rio_wlen = 0;
+}
+
+/*
+ * rio_writeb - Queue n bytes of usrbuf, which must stay as they are until
+ *     flushed. Returns n, or -1 if a flush to make room failed.
+ */
+ssize_t rio_writeb(rio_writer_t *wp, void *usrbuf, size_t n)
+{
+    struct iovec *last;
+
+    if (n == 0)
+        return 0;
+    /* Pieces formatted one after another are sent as one */
+    if (wp->rio_iovcnt > 0) {
+        last = &wp->rio_iov[wp->rio_iovcnt - 1];
+        if ((char *)last->iov_base + last->iov_len == usrbuf) {
+            last->iov_len += n;
+            return n;
+        }
+    }
+    if (wp->rio_iovcnt == RIO_MAXIOV && rio_flushb(wp) < 0)
+        return -1;
+    wp->rio_iov[wp->rio_iovcnt].iov_base = usrbuf;
+    wp->rio_iov[wp->rio_iovcnt].iov_len = n;
+    wp->rio_iovcnt++;
+    return n;
+}
+
+/*
+ * rio_printfb - Queue formatted text, flushing first if it does not fit.
+ *     Returns its length, or -1 on error or if it is longer than wbuf.
+ */
+ssize_t rio_printfb(rio_writer_t *wp, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+    char *p;
+
+    if (wp->rio_iovcnt == RIO_MAXIOV && rio_flushb(wp) < 0)
+        return -1;
+    va_start(ap, fmt);
+    n = vsnprintf(wp->rio_wbuf + wp->rio_wlen, RIO_BUFSIZE - wp->rio_wlen, fmt, ap);
+    va_end(ap);
+    if (n >= 0 && n >= RIO_BUFSIZE - wp->rio_wlen && wp->rio_wlen > 0) {
+        if (rio_flushb(wp) < 0)
+            return -1;
+        va_start(ap, fmt);
+        n = vsnprintf(wp->rio_wbuf, RIO_BUFSIZE, fmt, ap);
+        va_end(ap);
+    }
+    if (n < 0 || n >= RIO_BUFSIZE - wp->rio_wlen) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    p = wp->rio_wbuf + wp->rio_wlen;
+    wp->rio_wlen += n;
+    return rio_writeb(wp, p, n);
+}
+
+/*
+ * rio_flushb - Robustly write all queued output, with one writev if the
+ *     descriptor takes it. Returns 0, or -1 on error, in which case the
+ *     output stays queued and can be flushed again, e.g. to another fd.
+ */
+int rio_flushb(rio_writer_t *wp)
+{
+    struct iovec iov[RIO_MAXIOV], *p = iov;
+    int cnt = wp->rio_iovcnt;
+    ssize_t n;
+
+    memcpy(iov, wp->rio_iov, cnt * sizeof(struct iovec));
+    while (cnt > 0) {
+        if ((n = writev(wp->rio_fd, p, cnt)) < 0) {
+            if (errno == EINTR)  /* Interrupted by sig handler return */
+                continue;
+            return -1;
+        }
+        /* Skip what was written, resume within a piece if need be */
+        while (cnt > 0 && (size_t)n >= p->iov_len) {
+            n -= p->iov_len;
+            p++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            p->iov_base = (char *)p->iov_base + n;
+            p->iov_len -= n;
+        }
+    }
+    wp->rio_iovcnt = 0;
+    wp->rio_wlen = 0;
+    return 0;
+}
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -934,6 +1035,32 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
     return rc;
 } 
 
+void Rio_writeb(rio_writer_t *wp, void *usrbuf, size_t n)
+{
+    if (rio_writeb(wp, usrbuf, n) < 0)
+	unix_error("Rio_writeb error");
+}
+
+void Rio_printfb(rio_writer_t *wp, const char *fmt, ...)
+{
+    va_list ap;
+    char buf[RIO_BUFSIZE];
+    int n;
+
+    /* Formatted here so that it can be handed on */
+    va_start(ap, fmt);
+    n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n < 0 || n >= sizeof(buf) || rio_printfb(wp, "%s", buf) < 0)
+	unix_error("Rio_printfb error");
+}
+
+void Rio_flushb(rio_writer_t *wp)
+{
+    if (rio_flushb(wp) < 0)
+	unix_error("Rio_flushb error");
+}
+
 /******************************** 
  * Client/server helper functions
  ********************************/
@@ -25,6 +25,7 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -51,6 +52,17 @@ typedef struct {
 } rio_t;
 /* $end rio_t */
 
+/* Output batched for writev, pieces are kept by reference until flushed.
+   Formatted pieces are copied into wbuf. */
+#define RIO_MAXIOV 128
+typedef struct {
+    int rio_fd;                /* Descriptor to flush to */
+    int rio_iovcnt;            /* Pieces queued */
+    struct iovec rio_iov[RIO_MAXIOV];
+    size_t rio_wlen;           /* Bytes of wbuf in use */
+    char rio_wbuf[RIO_BUFSIZE];
+} rio_writer_t;
+
 /* External variables */
 extern int h_errno;    /* Defined by BIND for DNS errors */ 
 extern char **environ; /* Defined by libc */
@@ -178,6 +190,10 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n);
 void rio_readinitb(rio_t *rp, int fd); 
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+void rio_writeinitb(rio_writer_t *wp, int fd);
+ssize_t rio_writeb(rio_writer_t *wp, void *usrbuf, size_t n);
+ssize_t rio_printfb(rio_writer_t *wp, const char *fmt, ...);
+int rio_flushb(rio_writer_t *wp);
 
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
@@ -185,6 +201,9 @@ void Rio_writen(int fd, void *usrbuf, size_t n);
 void Rio_readinitb(rio_t *rp, int fd); 
 ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+void Rio_writeb(rio_writer_t *wp, void *usrbuf, size_t n);
+void Rio_printfb(rio_writer_t *wp, const char *fmt, ...);
+void Rio_flushb(rio_writer_t *wp);
 
 /* Reentrant protocol-independent client/server helpers */
 int open_clientfd(char *hostname, char *port);
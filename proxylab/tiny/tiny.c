@@ -222,24 +222,21 @@ void serve_dynamic(int fd, char *filename, char *cgiargs)
 void clienterror(int fd, char *cause, char *errnum, 
 		 char *shortmsg, char *longmsg) 
 {
-    char buf[MAXLINE];
+    rio_writer_t out;
+
+    rio_writeinitb(&out, fd);
 
     /* Print the HTTP response headers */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    Rio_printfb(&out, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
+    Rio_printfb(&out, "Content-type: text/html\r\n\r\n");
 
     /* Print the HTTP response body */
-    sprintf(buf, "<html><title>Tiny Error</title>");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<body bgcolor=""ffffff"">\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "%s: %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<p>%s: %s\r\n", longmsg, cause);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<hr><em>The Tiny Web server</em>\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    Rio_printfb(&out, "<html><title>Tiny Error</title>");
+    Rio_printfb(&out, "<body bgcolor=""ffffff"">\r\n");
+    Rio_printfb(&out, "%s: %s\r\n", errnum, shortmsg);
+    Rio_printfb(&out, "<p>%s: ", longmsg);
+    Rio_writeb(&out, cause, strlen(cause));
+    Rio_printfb(&out, "\r\n<hr><em>The Tiny Web server</em>\r\n");
+    Rio_flushb(&out);
 }
 /* $end clienterror */
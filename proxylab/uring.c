@@ -0,0 +1,790 @@
+/*
+ * uring.c - io_uring front end for the proxy
+ *
+ * Like event.c, each loop drives client and upstream sockets through a
+ * per-connection state machine, but instead of waiting for readiness and
+ * then calling recv and send, it queues the operations themselves on an
+ * io_uring and handles their completions. All operations queued while
+ * handling a batch of completions go to the kernel with the wait for the
+ * next batch, in one io_uring_enter. A connection has at most one
+ * operation in flight, so its state tells which one completed.
+ *
+ * Sockets are read and written through buffers registered with the ring
+ * once at startup, so the kernel doesn't map user pages per operation.
+ * The ring is driven with raw system calls, liburing is not needed.
+ *
+ * Connections have deadlines on the loop's timer wheel, as in event.c.
+ * The wait for completions ends when a timer may be due. A connection
+ * that expires with an operation in flight has it cancelled, and is
+ * answered or closed when the cancelled operation completes.
+ */
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#include "csapp.h"
+#include "cache.h"
+#include "uring.h"
+#include "alog.h"
+#include "stats.h"
+#include "http.h"
+#include "proxy.h"
+
+/* user_data of the operations not on behalf of a connection */
+#define OP_ACCEPT 1
+#define OP_WAKE 2
+#define OP_CANCEL 3
+
+typedef enum {
+    READ_REQUEST,       /* Reading request line and headers from client */
+    RESOLVE_UPSTREAM,   /* Waiting for a resolver to find the server */
+    CONNECT_UPSTREAM,   /* Connect to the server in flight */
+    WRITE_UPSTREAM,     /* Sending the request to the server */
+    READ_RESPONSE,      /* Reading the next piece of the response */
+    WRITE_RESPONSE,     /* Sending it to the client */
+    SEND_CACHED,        /* Sending a cached object to client */
+    SEND_PAGE           /* Sending an error or stats page, then close */
+} ConnState;
+
+/* The queues shared with the kernel, see io_uring_setup(2) */
+typedef struct {
+    int fd;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned sqEntries;
+    unsigned tail;                  /* Ours, published on submit */
+    struct io_uring_sqe *sqes;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+} Ring;
+
+typedef struct Loop Loop;
+
+typedef struct Conn {
+    Timer timer;                    /* First, the timer is the connection */
+    ConnState state;
+    int clientfd;
+    int upstreamfd;
+    char *buf;                      /* Request head, then response pieces */
+    int bufIndex;                   /* Registered buffer, -1 if malloc'ed */
+    size_t buflen, bufpos;
+    HttpRequest req;                /* Parsed as it arrives, views into buf */
+    char out[2 * MAXBUF];           /* Request to the server or a page */
+    size_t outlen, outpos;
+    char *key;                      /* Request line, the cache key */
+    Fill fill;                      /* Copy of the response for the cache */
+    HttpResponse res;               /* How far the response got */
+    Node *node;                     /* Cached object being sent */
+    size_t sent;
+    char hostname[MAXLINE];         /* Server to connect to */
+    char port[MAXLINE];
+    DnsAnswer answer;               /* Its addresses */
+    int addr;                       /* Next address to try */
+    Loop *loop;
+    AccessRecord log;
+    int timeout;                    /* Length of the current deadline */
+    int progress;                   /* Completions since it was armed */
+    int expired;                    /* Its operation is being cancelled */
+    int resolving;                  /* A resolver thread will hand it back */
+    int closed;                     /* Freed once the resolver is done */
+    struct Conn *nextResolved;
+    struct Conn *nextExpired;
+} Conn;
+
+struct Loop {
+    Ring ring;
+    int listenfd;
+    int wakefd;                     /* eventfd written by resolver threads */
+    uint64_t wakeCount;             /* Read from it by the ring */
+    Conn *resolved;                 /* Handed back by resolver threads */
+    sem_t mutex;                    /* Protects resolved */
+    char *bufs;                     /* URING_NBUFS registered buffers */
+    int freeBufs[URING_NBUFS];      /* Indexes of those not lent */
+    int nfree;
+    TimerWheel timers;              /* Deadlines, run after each batch */
+    Conn *expired;                  /* Whose timers fired */
+};
+
+static void process_request(Loop *loop, Conn *c);
+static void start_connect(Loop *loop, Conn *c);
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(SYS_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags,
+                       void *arg, size_t argsz)
+{
+    return syscall(SYS_io_uring_enter, fd, submit, wait, flags, arg, argsz);
+}
+
+static int uring_register(int fd, unsigned op, void *arg, unsigned n)
+{
+    return syscall(SYS_io_uring_register, fd, op, arg, n);
+}
+
+/* Create the ring and map its queues */
+static void ring_init(Ring *r)
+{
+    struct io_uring_params p;
+    char *sq, *cq;
+    size_t sqlen, cqlen;
+
+    /* Only the loop's thread submits, and it runs the kernel's deferred
+       work itself when it waits, rather than being interrupted for it */
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    if ((r->fd = uring_setup(URING_ENTRIES, &p)) < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        r->fd = uring_setup(URING_ENTRIES, &p);
+    }
+    if (r->fd < 0)
+        unix_error("io_uring_setup error");
+    sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+        app_error("io_uring without IORING_FEAT_SINGLE_MMAP");
+    if (!(p.features & IORING_FEAT_EXT_ARG))
+        app_error("io_uring without IORING_FEAT_EXT_ARG");
+
+    /* Both queues share one mapping */
+    if (cqlen > sqlen)
+        sqlen = cqlen;
+    sq = cq = Mmap(NULL, sqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQ_RING);
+    r->sqHead = (unsigned *)(sq + p.sq_off.head);
+    r->sqTail = (unsigned *)(sq + p.sq_off.tail);
+    r->sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sqArray = (unsigned *)(sq + p.sq_off.array);
+    r->sqEntries = p.sq_entries;
+    r->tail = *r->sqTail;
+    r->sqes = Mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    r->cqHead = (unsigned *)(cq + p.cq_off.head);
+    r->cqTail = (unsigned *)(cq + p.cq_off.tail);
+    r->cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+}
+
+/*
+ * ring_submit - hand the queued entries to the kernel and wait for wait
+ *               completions, or at most ms unless it is -1
+ */
+static void ring_submit(Ring *r, unsigned wait, int ms)
+{
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    struct io_uring_getevents_arg arg;
+
+    memset(&arg, 0, sizeof(arg));
+    if (wait && ms >= 0) {
+        flags |= IORING_ENTER_EXT_ARG;
+        arg.ts = (unsigned long)&ts;
+    }
+    __atomic_store_n(r->sqTail, r->tail, __ATOMIC_RELEASE);
+    /* Submit whatever the kernel hasn't taken yet */
+    while (uring_enter(r->fd, r->tail - __atomic_load_n(r->sqHead, __ATOMIC_ACQUIRE),
+                       wait, flags, flags & IORING_ENTER_EXT_ARG ? &arg : NULL,
+                       sizeof(arg)) < 0) {
+        if (errno == ETIME)
+            break;  /* Nothing completed in time */
+        if (errno != EINTR)
+            unix_error("io_uring_enter error");
+    }
+}
+
+/* A cleared entry to queue, submitting those queued if the ring is full */
+static struct io_uring_sqe* ring_get(Ring *r)
+{
+    struct io_uring_sqe *sqe;
+    unsigned i;
+
+    if (r->tail - __atomic_load_n(r->sqHead, __ATOMIC_ACQUIRE) == r->sqEntries)
+        ring_submit(r, 0, -1);
+    i = r->tail++ & *r->sqMask;
+    r->sqArray[i] = i;
+    sqe = &r->sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/* Queue a read or write of fd on behalf of c */
+static void queue_io(Loop *loop, Conn *c, int op, int fd, void *buf, size_t len)
+{
+    struct io_uring_sqe *sqe = ring_get(&loop->ring);
+
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->user_data = (unsigned long)c;
+    if (op == IORING_OP_READ_FIXED || op == IORING_OP_WRITE_FIXED)
+        sqe->buf_index = c->bufIndex;
+    else if (op == IORING_OP_SEND)
+        sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+/* Read into the buffer of c, registered if it has one */
+static void queue_recv(Loop *loop, Conn *c, int fd, char *buf, size_t len)
+{
+    queue_io(loop, c, c->bufIndex >= 0 ? IORING_OP_READ_FIXED : IORING_OP_RECV,
+             fd, buf, len);
+}
+
+/* Send from anywhere, from the buffer of c only if fixed */
+static void queue_send(Loop *loop, Conn *c, int fd, const char *buf, size_t len,
+                       int fixed)
+{
+    queue_io(loop, c, fixed && c->bufIndex >= 0 ? IORING_OP_WRITE_FIXED :
+             IORING_OP_SEND, fd, (void *)buf, len);
+}
+
+/* Accept connections until the kernel stops the multishot accept */
+static void queue_accept(Loop *loop)
+{
+    struct io_uring_sqe *sqe = ring_get(&loop->ring);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = OP_ACCEPT;
+}
+
+/* Read the eventfd, completes once a resolver thread writes it */
+static void queue_wake(Loop *loop)
+{
+    struct io_uring_sqe *sqe = ring_get(&loop->ring);
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = loop->wakefd;
+    sqe->addr = (unsigned long)&loop->wakeCount;
+    sqe->len = sizeof(loop->wakeCount);
+    sqe->user_data = OP_WAKE;
+}
+
+/* Cancel the operation c has in flight, the cancel's result is ignored */
+static void queue_cancel(Loop *loop, Conn *c)
+{
+    struct io_uring_sqe *sqe = ring_get(&loop->ring);
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long)c;
+    sqe->user_data = OP_CANCEL;
+}
+
+/* Register the buffer pool, connections malloc their own if it can't be */
+static void init_buffers(Loop *loop)
+{
+    struct iovec iov[URING_NBUFS];
+
+    loop->bufs = Malloc((size_t)URING_NBUFS * URING_BUFSIZE);
+    for (int i = 0; i < URING_NBUFS; i++) {
+        iov[i].iov_base = loop->bufs + (size_t)i * URING_BUFSIZE;
+        iov[i].iov_len = URING_BUFSIZE;
+        loop->freeBufs[i] = i;
+    }
+    loop->nfree = URING_NBUFS;
+    if (uring_register(loop->ring.fd, IORING_REGISTER_BUFFERS, iov, URING_NBUFS) < 0)
+        loop->nfree = 0;
+}
+
+/* Lend c a registered buffer if one is free */
+static void take_buffer(Loop *loop, Conn *c)
+{
+    if (loop->nfree > 0) {
+        c->bufIndex = loop->freeBufs[--loop->nfree];
+        c->buf = loop->bufs + (size_t)c->bufIndex * URING_BUFSIZE;
+    }
+    else {
+        c->bufIndex = -1;
+        c->buf = Malloc(URING_BUFSIZE);
+    }
+}
+
+/* Timer callback, the wheel is locked, leave the rest to expire_conns */
+static void conn_expired(Timer *t)
+{
+    Conn *c = (Conn *)t;
+
+    c->nextExpired = c->loop->expired;
+    c->loop->expired = c;
+}
+
+/* Give the connection ms from now, extended while completions keep coming */
+static void set_deadline(Loop *loop, Conn *c, int ms)
+{
+    timer_cancel(&loop->timers, &c->timer);
+    c->timeout = ms;
+    c->progress = 0;
+    timer_add(&loop->timers, &c->timer, ms, conn_expired);
+}
+
+/*
+ * close_conn - nothing is in flight for c any more, log it and free it.
+ *              While a resolver has it, wake_resolved frees it instead.
+ */
+static void close_conn(Loop *loop, Conn *c)
+{
+    timer_cancel(&loop->timers, &c->timer);
+    if (c->log.cache == ALOG_MISS)
+        c->log.bytes = c->fill.len;
+    alog_write(&c->log);
+    stats_record(&c->log);
+    close(c->clientfd);
+    if (c->upstreamfd >= 0)
+        close(c->upstreamfd);
+
+    if (c->bufIndex >= 0)
+        loop->freeBufs[loop->nfree++] = c->bufIndex;
+    else
+        Free(c->buf);
+    if (c->node != NULL)
+        releaseNode(c->node);
+    dropFill(&c->fill);
+    free(c->key);
+    if (c->resolving) {
+        c->closed = 1;
+        return;
+    }
+    Free(c);
+}
+
+/* Queue an error page for the client, same content as clienterror */
+static void send_error(Loop *loop, Conn *c, char *cause, char *errnum,
+                       char *shortmsg, char *longmsg)
+{
+    c->outlen = snprintf(c->out, sizeof(c->out),
+        "HTTP/1.0 %s %s\r\n"
+        "Content-type: text/html\r\n\r\n"
+        "<html><title>Proxy Error</title><body bgcolor=ffffff>\r\n"
+        "%s: %s\r\n"
+        "<p>%s: %.1024s\r\n"
+        "<hr><em>The Proxy Web server</em>\r\n",
+        errnum, shortmsg, errnum, shortmsg, longmsg, cause);
+    c->outpos = 0;
+    c->log.cache = ALOG_NONE;
+    c->log.status = atoi(errnum);
+    c->state = SEND_PAGE;
+    set_deadline(loop, c, CLIENT_TIMEOUT_MS);
+    queue_send(loop, c, c->clientfd, c->out, c->outlen, 0);
+}
+
+/* Queue the stats page for the client, there is no worker pool to report */
+static void send_stats(Loop *loop, Conn *c)
+{
+    char extra[MAXLINE];
+
+    sprintf(extra, "\"cache_size\":%zu", cacheSize(&proxyCache));
+    c->outlen = stats_page(c->out, sizeof(c->out), extra);
+    c->outpos = 0;
+    c->log.status = 200;
+    c->state = SEND_PAGE;
+    set_deadline(loop, c, CLIENT_TIMEOUT_MS);
+    queue_send(loop, c, c->clientfd, c->out, c->outlen, 0);
+}
+
+/* Called by a resolver thread, queue the connection for its loop */
+static void resolved(void *arg)
+{
+    Conn *c = arg;
+    Loop *loop = c->loop;
+    uint64_t one = 1;
+
+    P(&loop->mutex);
+    c->nextResolved = loop->resolved;
+    loop->resolved = c;
+    V(&loop->mutex);
+    if (write(loop->wakefd, &one, sizeof(one)) < 0)
+        unix_error("eventfd write error");
+}
+
+/* Connect to the server once its addresses are known */
+static void resolve_upstream(Loop *loop, Conn *c)
+{
+    c->state = RESOLVE_UPSTREAM;
+    if (!dns_resolve(&dnsCache, c->hostname, c->port, &c->answer, resolved, c)) {
+        c->resolving = 1;
+        return;
+    }
+    if (c->answer.naddrs == 0) {
+        send_error(loop, c, c->hostname, "502", "Bad Gateway",
+                   "Proxy could not resolve the server");
+        return;
+    }
+    c->addr = 0;
+    start_connect(loop, c);
+}
+
+/* Resume the connections whose server names were resolved */
+static void wake_resolved(Loop *loop)
+{
+    Conn *c;
+
+    P(&loop->mutex);
+    c = loop->resolved;
+    loop->resolved = NULL;
+    V(&loop->mutex);
+
+    while (c != NULL) {
+        Conn *next = c->nextResolved;
+        c->resolving = 0;
+        if (c->closed)
+            Free(c);
+        else if (c->state == RESOLVE_UPSTREAM)
+            resolve_upstream(loop, c);  /* Not timed out meanwhile */
+        c = next;
+    }
+}
+
+/* Queue a connect to the next server address that gets a socket */
+static void start_connect(Loop *loop, Conn *c)
+{
+    struct io_uring_sqe *sqe;
+
+    for (; c->addr < c->answer.naddrs; c->addr++) {
+        DnsAddr *a = &c->answer.addrs[c->addr];
+        if ((c->upstreamfd = socket(a->family, SOCK_STREAM, 0)) < 0)
+            continue;
+        c->state = CONNECT_UPSTREAM;
+        sqe = ring_get(&loop->ring);
+        sqe->opcode = IORING_OP_CONNECT;
+        sqe->fd = c->upstreamfd;
+        sqe->addr = (unsigned long)&a->addr;
+        sqe->off = a->len;
+        sqe->user_data = (unsigned long)c;
+        return;
+    }
+    send_error(loop, c, c->key, "502", "Bad Gateway",
+               "Proxy could not connect to the server");
+}
+
+/*
+ * build_request - rewrite the client request head into out, with the same
+ *                 headers forward_requesthdrs sends
+ */
+static void build_request(Conn *c, char *method)
+{
+    HttpRequest *req = &c->req;
+    int hasHost = 0;
+
+    c->outlen = snprintf(c->out, sizeof(c->out), "%s %s%.*s HTTP/1.0\r\n", method,
+                         req->path.len > 0 && req->path.p[0] == '/' ? "" : "/",
+                         (int)req->path.len, req->path.p);
+    for (int i = 0; i < req->nheaders; i++) {
+        HttpHeader *h = &req->headers[i];
+        if (http_caseeq(h->name, "Host"))
+            hasHost = 1;
+        if (http_hop_by_hop(h))
+            continue;
+        memcpy(c->out + c->outlen, h->line.p, h->line.len);
+        c->outlen += h->line.len;
+    }
+
+    if (!hasHost)
+        c->outlen += sprintf(c->out + c->outlen, "Host: %s\r\n", c->hostname);
+    c->outlen += sprintf(c->out + c->outlen, "%s%s%s%s", user_agent_hdr,
+                         "Connection: close\r\n",
+                         "Proxy-Connection: close\r\n", "\r\n");
+    c->outpos = 0;
+}
+
+/* The whole request head has arrived, serve it from cache or start a fetch */
+static void process_request(Loop *loop, Conn *c)
+{
+    HttpRequest *req = &c->req;
+    char method[HTTP_MAX_METHOD + 1];
+
+    c->key = Malloc(req->line.len + 1);
+    http_copy(c->key, req->line.len + 1, req->line);
+    alog_request(&c->log, c->key);
+    initFill(&c->fill, c->key);
+
+    if (http_eq(req->uri, STATS_URI)) {
+        send_stats(loop, c);
+        return;
+    }
+
+    /* Check whether the request is cached, send it straight from the cache.
+       A stale copy is fetched again in full and replaced. */
+    if ((c->node = readCache(&proxyCache, c->key)) != NULL && !isFresh(c->node)) {
+        releaseNode(c->node);
+        c->node = NULL;
+    }
+    if (c->node != NULL) {
+        alog_response(&c->log, ALOG_HIT, c->node->value, c->node->valuelen);
+        c->log.bytes = c->node->valuelen;
+        c->sent = 0;
+        c->state = SEND_CACHED;
+        set_deadline(loop, c, CLIENT_TIMEOUT_MS);
+        queue_send(loop, c, c->clientfd, c->node->value, c->node->valuelen, 0);
+        return;
+    }
+
+    http_copy(method, sizeof(method), req->method);
+    if (!http_caseeq(req->method, "GET")) {
+        send_error(loop, c, method, "501", "Not Implemented",
+                   "Proxy does not implement this method");
+        return;
+    }
+    if (req->host.len == 0) {
+        send_error(loop, c, c->key, "501", "Not Implemented",
+                   "Proxy does not implement this uri");
+        return;
+    }
+    http_copy(c->hostname, sizeof(c->hostname), req->host);
+    if (req->port.len == 0 || http_copy(c->port, sizeof(c->port), req->port) == 0)
+        strcpy(c->port, "80");
+    build_request(c, method);
+    http_response_init(&c->res);
+    c->log.cache = ALOG_MISS;
+
+    /* Resolving, connecting and every silence of the server count */
+    set_deadline(loop, c, UPSTREAM_TIMEOUT_MS);
+    resolve_upstream(loop, c);
+}
+
+/*
+ * timed_out - the deadline passed without a completion and nothing is in
+ *             flight, answer the client if it waits
+ */
+static void timed_out(Loop *loop, Conn *c)
+{
+    switch (c->state) {
+    case READ_REQUEST:
+        if (c->buflen == 0)
+            break;
+        send_error(loop, c, "request", "408", "Request Timeout",
+                   "Proxy timed out waiting for the request");
+        return;
+
+    case RESOLVE_UPSTREAM:
+    case CONNECT_UPSTREAM:
+    case WRITE_UPSTREAM:
+    case READ_RESPONSE:
+    case WRITE_RESPONSE:
+        /* Part of the response went out, it is never cached */
+        if (c->log.firstByte != 0)
+            break;
+        if (c->upstreamfd >= 0) {
+            close(c->upstreamfd);
+            c->upstreamfd = -1;
+        }
+        send_error(loop, c, c->hostname, "504", "Gateway Timeout",
+                   "Proxy timed out waiting for the server");
+        return;
+
+    default:
+        break;
+    }
+    close_conn(loop, c);
+}
+
+/* Handle the connections whose timers fired, extending those with progress */
+static void expire_conns(Loop *loop)
+{
+    Conn *c;
+
+    while ((c = loop->expired) != NULL) {
+        loop->expired = c->nextExpired;
+        if (c->progress) {
+            set_deadline(loop, c, c->timeout);
+        } else if (c->state == RESOLVE_UPSTREAM) {
+            timed_out(loop, c);  /* The resolver has it, not the ring */
+        } else {
+            c->expired = 1;
+            queue_cancel(loop, c);
+        }
+    }
+}
+
+/*
+ * complete - handle the result of the operation c had in flight, which is
+ *            the byte count or -errno. Queues the next one or closes c.
+ */
+static void complete(Loop *loop, Conn *c, int res)
+{
+    int rc;
+
+    if (c->expired) {
+        /* Cancelled or not, the deadline has passed */
+        c->expired = 0;
+        timed_out(loop, c);
+        return;
+    }
+    /* The head must arrive in time, anything later is extended */
+    if (c->state != READ_REQUEST)
+        c->progress = 1;
+
+    switch (c->state) {
+    case READ_REQUEST:
+        if (res <= 0)
+            break;
+        c->buflen += res;
+        rc = http_parse_request(&c->req, c->buf, c->buflen, MAXLINE - 1);
+        if (rc > 0)
+            process_request(loop, c);
+        else if (rc == HTTP_TOO_LARGE)
+            send_error(loop, c, "request", "431", "Request Header Fields Too Large",
+                       "Request header too large");
+        else if (rc == HTTP_BAD)
+            send_error(loop, c, "request", "400", "Bad Request",
+                       "Proxy could not parse the request");
+        else
+            queue_recv(loop, c, c->clientfd, c->buf + c->buflen,
+                       MAXLINE - 1 - c->buflen);
+        return;
+
+    case CONNECT_UPSTREAM:
+        if (res < 0) {
+            /* Try the next address */
+            close(c->upstreamfd);
+            c->upstreamfd = -1;
+            c->addr++;
+            start_connect(loop, c);
+            return;
+        }
+        c->log.connect = alog_now();
+        c->state = WRITE_UPSTREAM;
+        queue_send(loop, c, c->upstreamfd, c->out, c->outlen, 0);
+        return;
+
+    case WRITE_UPSTREAM:
+        if (res < 0)
+            break;
+        if ((c->outpos += res) < c->outlen) {
+            queue_send(loop, c, c->upstreamfd, c->out + c->outpos,
+                       c->outlen - c->outpos, 0);
+            return;
+        }
+        c->state = READ_RESPONSE;
+        queue_recv(loop, c, c->upstreamfd, c->buf, URING_BUFSIZE);
+        return;
+
+    case READ_RESPONSE:
+        if (res <= 0) {
+            /* Cache it only if it arrived whole, and is small enough */
+            if (res == 0 && http_response_complete(&c->res))
+                writeCache(&proxyCache, c->key, &c->fill, 0);
+            break;
+        }
+        if (c->log.firstByte == 0)
+            alog_response(&c->log, ALOG_MISS, c->buf, res);
+        http_parse_response(&c->res, c->buf, res);
+        appendFill(&c->fill, c->buf, res);
+        c->buflen = res;
+        c->bufpos = 0;
+        c->state = WRITE_RESPONSE;
+        queue_send(loop, c, c->clientfd, c->buf, c->buflen, 1);
+        return;
+
+    case WRITE_RESPONSE:
+        if (res < 0)
+            break;
+        if ((c->bufpos += res) < c->buflen) {
+            queue_send(loop, c, c->clientfd, c->buf + c->bufpos,
+                       c->buflen - c->bufpos, 1);
+            return;
+        }
+        c->state = READ_RESPONSE;
+        queue_recv(loop, c, c->upstreamfd, c->buf, URING_BUFSIZE);
+        return;
+
+    case SEND_CACHED:
+        if (res < 0 || (c->sent += res) == c->node->valuelen)
+            break;
+        queue_send(loop, c, c->clientfd, c->node->value + c->sent,
+                   c->node->valuelen - c->sent, 0);
+        return;
+
+    case SEND_PAGE:
+        if (res < 0 || (c->outpos += res) == c->outlen)
+            break;
+        queue_send(loop, c, c->clientfd, c->out + c->outpos,
+                   c->outlen - c->outpos, 0);
+        return;
+
+    default:
+        return;
+    }
+    close_conn(loop, c);
+}
+
+/* Start reading the request of a connection the ring accepted */
+static void accepted_conn(Loop *loop, int connfd)
+{
+    Conn *c = Calloc(1, sizeof(Conn));
+
+    c->state = READ_REQUEST;
+    http_init(&c->req);
+    c->clientfd = connfd;
+    c->upstreamfd = -1;
+    c->loop = loop;
+    take_buffer(loop, c);
+    alog_start(&c->log, 0);
+    alog_client(&c->log, connfd);
+    set_deadline(loop, c, CLIENT_TIMEOUT_MS);
+    queue_recv(loop, c, connfd, c->buf, MAXLINE - 1);
+}
+
+static void* uring_loop(void *vargp)
+{
+    Loop *loop = vargp;
+    Ring *r = &loop->ring;
+    struct io_uring_cqe *cqe;
+    unsigned head, tail;
+
+    /* Made here, the thread that creates a single issuer ring submits */
+    ring_init(r);
+    init_buffers(loop);
+    queue_accept(loop);
+    queue_wake(loop);
+    while (1) {
+        /* Submit everything queued by the last batch, wait for the next
+           until a deadline may be due */
+        ring_submit(r, 1, timer_next(&loop->timers));
+
+        head = *r->cqHead;
+        tail = __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            cqe = &r->cqes[head & *r->cqMask];
+            if (cqe->user_data == OP_ACCEPT) {
+                if (cqe->res >= 0)
+                    accepted_conn(loop, cqe->res);
+                if (!(cqe->flags & IORING_CQE_F_MORE))
+                    queue_accept(loop);
+            }
+            else if (cqe->user_data == OP_WAKE) {
+                wake_resolved(loop);
+                queue_wake(loop);
+            }
+            else if (cqe->user_data != OP_CANCEL)
+                complete(loop, (Conn *)(unsigned long)cqe->user_data, cqe->res);
+        }
+        __atomic_store_n(r->cqHead, head, __ATOMIC_RELEASE);
+        timer_run(&loop->timers);
+        expire_conns(loop);
+    }
+    return NULL;
+}
+
+void start_uring_loops(int listenfd, int nloops)
+{
+    pthread_t tid;
+    Loop *loops;
+
+    if (nloops < 1)
+        nloops = 1;
+    loops = Calloc(nloops, sizeof(Loop));
+    for (int i = 0; i < nloops; i++) {
+        loops[i].listenfd = listenfd;
+        if ((loops[i].wakefd = eventfd(0, 0)) < 0)
+            unix_error("eventfd error");
+        Sem_init(&loops[i].mutex, 0, 1);
+        timer_setup(&loops[i].timers);
+    }
+
+    for (int i = 1; i < nloops; i++)
+        Pthread_create(&tid, NULL, uring_loop, &loops[i]);
+    uring_loop(&loops[0]);
+}
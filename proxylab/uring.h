@@ -0,0 +1,20 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include "csapp.h"
+
+/* Submission queue entries per ring */
+#define URING_ENTRIES 256
+
+/* Buffers each ring registers and lends to its connections, one each.
+   A request head must fit in one. */
+#define URING_NBUFS 64
+#define URING_BUFSIZE (1 << 16)
+#if URING_BUFSIZE < MAXLINE
+#error "a registered buffer must hold a request head"
+#endif
+
+/* Run nloops io_uring loops sharing listenfd, never returns */
+void start_uring_loops(int listenfd, int nloops);
+
+#endif
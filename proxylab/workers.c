@@ -0,0 +1,88 @@
+/*
+ * workers.c - prethreaded worker pool that grows and shrinks with load
+ *
+ * A worker is added when a descriptor is submitted while the buffer holds
+ * more descriptors than there are idle workers to take them, which usually
+ * means the busy ones are all waiting on slow servers. Workers above the
+ * minimum retire after WORKERS_IDLE_MS without a connection.
+ */
+#include "workers.h"
+
+static void* worker(void *vargp)
+{
+    WorkerPool *wp = vargp;
+    int fd, n;
+
+    Pthread_detach(pthread_self());
+    while (1)
+    {
+        if (!sbuf_remove_timed(&wp->sbuf, WORKERS_IDLE_MS, &fd))
+        {
+            /* Idle for long, leave unless that would go below min */
+            n = __atomic_load_n(&wp->nworkers, __ATOMIC_RELAXED);
+            if (n > wp->min &&
+                __sync_bool_compare_and_swap(&wp->nworkers, n, n - 1))
+            {
+                __sync_fetch_and_sub(&wp->nidle, 1);
+                __sync_fetch_and_add(&wp->retired, 1);
+                return NULL;
+            }
+            continue;
+        }
+        __sync_fetch_and_sub(&wp->nidle, 1);
+        wp->serve(fd);
+        __sync_fetch_and_add(&wp->nidle, 1);
+    }
+}
+
+/* Start one more worker unless there are max, it counts as idle at once */
+static int add_worker(WorkerPool *wp)
+{
+    pthread_t tid;
+    int n;
+
+    do {
+        n = __atomic_load_n(&wp->nworkers, __ATOMIC_RELAXED);
+        if (n >= wp->max)
+            return 0;
+    } while (!__sync_bool_compare_and_swap(&wp->nworkers, n, n + 1));
+    __sync_fetch_and_add(&wp->nidle, 1);
+    Pthread_create(&tid, NULL, worker, wp);
+    return 1;
+}
+
+/* Start min workers, the pool never grows beyond max */
+void workers_init(WorkerPool *wp, int min, int max, void (*serve)(int fd))
+{
+    sbuf_init(&wp->sbuf, WORKERS_SBUFSIZE);
+    wp->serve = serve;
+    wp->min = min;
+    wp->max = max;
+    wp->nworkers = wp->nidle = 0;
+    wp->added = wp->retired = 0;
+    for (int i = 0; i < min; i++)
+        add_worker(wp);
+}
+
+/* Queue a connected descriptor, adding a worker if none is left to take it */
+void workers_submit(WorkerPool *wp, int fd)
+{
+    if (sbuf_count(&wp->sbuf) + 1 > __atomic_load_n(&wp->nidle, __ATOMIC_RELAXED) &&
+        add_worker(wp))
+        __sync_fetch_and_add(&wp->added, 1);
+    sbuf_insert(&wp->sbuf, fd);
+}
+
+/*
+ * workers_stats - snapshot of the queue depth, the number of running and
+ *                 idle workers, and how many were added and retired so far
+ */
+void workers_stats(WorkerPool *wp, int *queued, int *nworkers, int *nidle,
+                   int *added, int *retired)
+{
+    *queued = sbuf_count(&wp->sbuf);
+    *nworkers = __atomic_load_n(&wp->nworkers, __ATOMIC_RELAXED);
+    *nidle = __atomic_load_n(&wp->nidle, __ATOMIC_RELAXED);
+    *added = __atomic_load_n(&wp->added, __ATOMIC_RELAXED);
+    *retired = __atomic_load_n(&wp->retired, __ATOMIC_RELAXED);
+}
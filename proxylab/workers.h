@@ -0,0 +1,26 @@
+#ifndef __WORKERS_H__
+#define __WORKERS_H__
+
+#include "csapp.h"
+#include "sbuf.h"
+
+#define WORKERS_SBUFSIZE 16
+#define WORKERS_IDLE_MS 10000  /* How long a worker above min waits to retire */
+
+/* Prethreaded workers serving connected descriptors from a shared buffer */
+typedef struct {
+    sbuf_t sbuf;               /* Connected descriptors not yet served */
+    void (*serve)(int fd);
+    int min, max;              /* Limits on the number of workers */
+    int nworkers;              /* Running, changed atomically */
+    int nidle;                 /* Waiting on sbuf, changed atomically */
+    int added;                 /* Workers started beyond min, atomically */
+    int retired;               /* Workers that left idle, atomically */
+} WorkerPool;
+
+void workers_init(WorkerPool *wp, int min, int max, void (*serve)(int fd));
+void workers_submit(WorkerPool *wp, int fd);
+void workers_stats(WorkerPool *wp, int *queued, int *nworkers, int *nidle,
+                   int *added, int *retired);
+
+#endif